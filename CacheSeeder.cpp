@@ -0,0 +1,356 @@
+#include <math.h>
+
+#include "CacheSeeder.h"
+#include "MercatorProjection.h"
+
+const int     SEED_MAX_CELLS      = 1000000;  // Maximum number of chunks per zoom level
+const int     SEED_MAX_ATTEMPTS   = 3;        // Download attempts per chunk
+const int     SEED_TIMEOUT        = 15000;    // Request timeout (in milliseconds)
+const int     SEED_PROGRESS_TIME  = 1000;     // Progress report interval (in milliseconds)
+const qint64  SEED_CHUNK_SIZE     = 60000;    // Chunk file size estimate if nothing is cached yet (in bytes)
+
+static qint64 cellKey(qint64 x, qint64 y)
+{
+  return (y << 32) | (quint32)x;
+}
+
+CacheSeeder::CacheSeeder(const QString& apiKey, const QString& cacheDir, QObject* parent)
+  : QObject         ( parent )
+  , mApiKey         ( apiKey )
+  , mCacheDir       ( cacheDir )
+  , mCorridor       ( 200.0 )
+  , mZoomMin        ( 12 )
+  , mZoomMax        ( 18 )
+  , mTypes          ( QStringList() << "roadmap" )
+  , mJobs           ( 4 )
+  , mRate           ( 10.0 )
+  , mDryRun         ( false )
+  , mTotal          ( 0 )
+  , mDone           ( 0 )
+  , mFailed         ( 0 )
+  , mBytes          ( 0 )
+{
+  mNetworkManager = new QNetworkAccessManager(this);
+  connect(mNetworkManager, SIGNAL(finished(QNetworkReply*)), this, SLOT(onRequestFinished(QNetworkReply*)));
+
+  mTimer = new QTimer(this);
+  connect(mTimer, SIGNAL(timeout()), this, SLOT(onTimer()));
+}
+
+bool CacheSeeder::parseArguments(const QStringList& args)
+{
+  for(int i = 0; i < args.size(); ++i)
+  {
+    const QString& option = args[i];
+    if (option == "--dry-run")
+    {
+      mDryRun = true;
+      continue;
+    }
+
+    if (i + 1 >= args.size())
+    {
+      qCritical() << "Missing value of" << option;
+      return false;
+    }
+    const QString value = args[++i];
+    bool ok = true;
+
+    if (option == "--box")
+    {
+      const QStringList parts = value.split(",");
+      double v[4] = { 0.0, 0.0, 0.0, 0.0 };
+      ok = parts.size() == 4;
+      for(int j = 0; j < 4 && ok; ++j)
+        v[j] = parts[j].toDouble(&ok);
+      ok = ok && qAbs(v[1]) <= 180.0 && qAbs(v[3]) <= 180.0;
+
+      // Longitudes go from west to east: a box with lon1 > lon2 crosses the 180th meridian
+      // and is split there
+      const double south = qMin(v[0], v[2]);
+      const double north = qMax(v[0], v[2]);
+      mBoxes.clear();
+      if (v[1] <= v[3])
+        mBoxes.append(QRectF(QPointF(v[1], south), QPointF(v[3], north)));
+      else
+      {
+        mBoxes.append(QRectF(QPointF(v[1],   south), QPointF(180.0, north)));
+        mBoxes.append(QRectF(QPointF(-180.0, south), QPointF(v[3],  north)));
+      }
+    }
+    else if (option == "--track")
+      ok = loadTrack(value);
+    else if (option == "--corridor")
+      mCorridor = value.toDouble(&ok);
+    else if (option == "--zoom")
+    {
+      const QStringList parts = value.split("-");
+      bool ok1 = true;
+      mZoomMin = parts[0].toInt(&ok);
+      mZoomMax = (parts.size() > 1) ? parts[1].toInt(&ok1) : mZoomMin;
+      ok = ok && ok1 && parts.size() <= 2 && mZoomMin <= mZoomMax &&
+           mZoomMin >= MERCATOR_ZOOM_MIN && mZoomMax <= MERCATOR_ZOOM_MAX;
+    }
+    else if (option == "--type")
+      mTypes = value.split(",", QString::SkipEmptyParts);
+    else if (option == "--jobs")
+    {
+      mJobs = value.toInt(&ok);
+      ok = ok && mJobs > 0;
+    }
+    else if (option == "--rate")
+    {
+      mRate = value.toDouble(&ok);
+      ok = ok && mRate > 0;
+    }
+    else
+    {
+      qCritical() << "Unknown option" << option;
+      return false;
+    }
+
+    if (!ok)
+    {
+      qCritical() << "Invalid value of" << option << ":" << value;
+      return false;
+    }
+  }
+
+  if (mBoxes.isEmpty() && mTrack.isEmpty())
+  {
+    qCritical() << "Nothing to seed: --box or --track is required";
+    return false;
+  }
+  return true;
+}
+
+bool CacheSeeder::loadTrack(const QString& fileName)
+{
+  QFile f(fileName);
+  if (!f.open(QIODevice::ReadOnly))
+  {
+    qCritical() << "Unable to read track" << fileName;
+    return false;
+  }
+
+  if (fileName.endsWith(".gpx", Qt::CaseInsensitive))
+  {
+    // GPX: track, route and waypoints
+    QXmlStreamReader xml(&f);
+    while (!xml.atEnd())
+    {
+      if (xml.readNext() != QXmlStreamReader::StartElement)
+        continue;
+      if (xml.name() == "trkpt" || xml.name() == "rtept" || xml.name() == "wpt")
+        mTrack.append(qMakePair(xml.attributes().value("lat").toString().toDouble(),
+                                xml.attributes().value("lon").toString().toDouble()));
+    }
+    if (xml.hasError())
+    {
+      qCritical() << "Invalid GPX file" << fileName << ":" << xml.errorString();
+      return false;
+    }
+  }
+  else
+  {
+    // Recorded log: <date> <time> <latitude> <longitude> <gps delay>
+    while (!f.atEnd())
+    {
+      const QStringList parts = QString(f.readLine()).split(" ", QString::SkipEmptyParts);
+      if (parts.size() >= 4)
+        mTrack.append(qMakePair(parts[2].toDouble(), parts[3].toDouble()));
+    }
+  }
+
+  qDebug() << "Track" << fileName << ":" << mTrack.size() << "points";
+  return true;
+}
+
+void CacheSeeder::addArea(const QRectF& area, int zoom, QSet<qint64>& cells)const
+{
+  // Every point is covered by the chunk of the nearest grid node
+  const qint64 maxCell = (qint64)(MERCATOR_WORLD_SIZE[zoom] / CHUNK_GRID);
+  const qint64 x0 = qMax<qint64>(0,       (qint64)floor(area.left()   / CHUNK_GRID + 0.5));
+  const qint64 x1 = qMin<qint64>(maxCell, (qint64)floor(area.right()  / CHUNK_GRID + 0.5));
+  const qint64 y0 = qMax<qint64>(0,       (qint64)floor(area.top()    / CHUNK_GRID + 0.5));
+  const qint64 y1 = qMin<qint64>(maxCell, (qint64)floor(area.bottom() / CHUNK_GRID + 0.5));
+
+  // Grid nodes on the 180th meridian are the same from both sides
+  for(qint64 y = y0; y <= y1; ++y)
+    for(qint64 x = x0; x <= x1; ++x)
+      cells.insert(cellKey(x % maxCell, y));
+}
+
+bool CacheSeeder::prepare()
+{
+  QDir().mkpath(mCacheDir);
+
+  int cached = 0;
+  qint64 cachedBytes = 0;
+
+  for(int zoom = mZoomMin; zoom <= mZoomMax; ++zoom)
+  {
+    QSet<qint64> cells;
+
+    double count = 0.0;
+    QList<QRectF> areas;
+    for(int i = 0; i < mBoxes.size(); ++i)
+    {
+      const QPointF p1 = mercatorProject(mBoxes[i].bottom(), mBoxes[i].left(),  zoom);  // North-west corner
+      const QPointF p2 = mercatorProject(mBoxes[i].top(),    mBoxes[i].right(), zoom);  // South-east corner
+      count += (p2.x() - p1.x()) / CHUNK_GRID * (p2.y() - p1.y()) / CHUNK_GRID;
+      areas.append(QRectF(p1, p2));
+    }
+    if (count > SEED_MAX_CELLS)
+    {
+      qCritical() << "Too many chunks on zoom level" << zoom << ":" << (qint64)count;
+      return false;
+    }
+    for(int i = 0; i < areas.size(); ++i)
+      addArea(areas[i], zoom, cells);
+
+    // Corridor: track segments are sampled with a step of half a chunk
+    for(int i = 0; i < mTrack.size(); ++i)
+    {
+      const QPointF p = mercatorProject(mTrack[i].first, mTrack[i].second, zoom);
+      const double radius = mCorridor / mercatorResolution(mTrack[i].first, zoom);
+      const QPointF q = (i > 0) ? mercatorProject(mTrack[i - 1].first, mTrack[i - 1].second, zoom) : p;
+
+      const int steps = qMax(1, (int)ceil(sqrt(pow(p.x() - q.x(), 2) + pow(p.y() - q.y(), 2)) / (CHUNK_GRID / 2)));
+      for(int j = 1; j <= steps; ++j)
+      {
+        const QPointF c = q + (p - q) * j / steps;
+        addArea(QRectF(c.x() - radius, c.y() - radius, 2 * radius, 2 * radius), zoom, cells);
+      }
+
+      if (cells.size() > SEED_MAX_CELLS)
+      {
+        qCritical() << "Too many chunks on zoom level" << zoom;
+        return false;
+      }
+    }
+
+    for(auto iter = cells.constBegin(); iter != cells.constEnd(); ++iter)
+    {
+      const qint64 x = (qint32)(*iter & 0xffffffff);
+      const qint64 y = *iter >> 32;
+
+      Chunk chunk;
+      chunk.zoom = zoom;
+      mercatorUnproject(QPointF(x * CHUNK_GRID, y * CHUNK_GRID), zoom, chunk.latitude, chunk.longitude);
+      const QString hash = TileEngine::chunkHash(zoom, chunk.latitude, chunk.longitude);
+
+      for(int i = 0; i < mTypes.size(); ++i)
+      {
+        chunk.type = mTypes[i];
+        chunk.key  = TileEngine::chunkKey(mTypes[i], hash);
+
+        QFileInfo info(QString("%1/%2.png").arg(mCacheDir).arg(chunk.key));
+        if (info.exists())
+        {
+          ++cached;
+          cachedBytes += info.size();
+        }
+        else
+          mQueue.append(chunk);
+      }
+    }
+  }
+
+  mTotal = mQueue.size();
+
+  const qint64 chunkSize = cached ? cachedBytes / cached : SEED_CHUNK_SIZE;
+  qDebug() << "Chunks:" << mTotal + cached << "total," << cached << "cached," << mTotal << "to download";
+  qDebug() << "Estimate:" << QString("%1 MB,").arg(mTotal * chunkSize / 1e6, 0, 'f', 1).toLatin1().constData()
+           << QString("%1 min at %2 requests/s").arg(mTotal / mRate / 60, 0, 'f', 1).arg(mRate).toLatin1().constData();
+
+  if (mTotal + cached > DISK_CACHE_SIZE)
+    qWarning() << "Warning: the region exceeds the disk cache size (" << DISK_CACHE_SIZE
+               << "chunks ), the oldest chunks will be removed by the cache cleaner";
+  return true;
+}
+
+void CacheSeeder::start()
+{
+  mStartTime    = QDateTime::currentDateTime();
+  mProgressTime = mStartTime;
+
+  mTimer->setInterval(qMax(1, (int)(1000 / mRate)));
+  mTimer->start();
+  onTimer();
+}
+
+void CacheSeeder::onTimer()
+{
+  if (mQueue.isEmpty() && mRequests.isEmpty())
+  {
+    mTimer->stop();
+    printProgress(true);
+    qDebug() << "Seeding finished:" << mDone << "downloaded," << mFailed << "failed";
+    QCoreApplication::exit(mFailed ? 1 : 0);
+    return;
+  }
+
+  // One request per tick: the timer interval limits the request rate
+  if (mQueue.isEmpty() || mRequests.size() >= mJobs)
+    return;
+
+  const Chunk chunk = mQueue.takeFirst();
+  QNetworkReply* reply = mNetworkManager->get(QNetworkRequest(QUrl(
+                           TileEngine::chunkUrl(chunk.type, chunk.latitude, chunk.longitude, chunk.zoom, mApiKey))));
+  mRequests[reply] = chunk;
+  QTimer::singleShot(SEED_TIMEOUT, reply, SLOT(abort()));
+}
+
+void CacheSeeder::onRequestFinished(QNetworkReply* reply)
+{
+  Chunk chunk = mRequests.take(reply);
+  const QByteArray data = reply->readAll();
+  const bool ok = reply->error() == QNetworkReply::NoError && QImage().loadFromData(data);
+  reply->deleteLater();
+
+  if (ok)
+  {
+    // Writing to a temporary file first: interrupted runs leave no broken chunks
+    const QString fileName = QString("%1/%2.png").arg(mCacheDir).arg(chunk.key);
+    if (writeFileAtomic(fileName, data))
+    {
+      writeChunkMeta(QString("%1/%2.meta").arg(mCacheDir).arg(chunk.key), replyChunkMeta(reply));
+      ++mDone;
+      mBytes += data.size();
+      printProgress(false);
+      return;
+    }
+    qWarning() << "Unable to write" << fileName;
+  }
+
+  if (++chunk.attempts < SEED_MAX_ATTEMPTS)
+    mQueue.append(chunk);
+  else
+  {
+    qWarning() << "Chunk" << chunk.key << "FAILED:" << reply->errorString();
+    ++mFailed;
+  }
+  printProgress(false);
+}
+
+void CacheSeeder::printProgress(bool force)
+{
+  const QDateTime now = QDateTime::currentDateTime();
+  if (!force && mProgressTime.msecsTo(now) < SEED_PROGRESS_TIME)
+    return;
+  mProgressTime = now;
+
+  const double elapsed = qMax<qint64>(1, mStartTime.msecsTo(now)) / 1000.0;
+  const double rate    = mDone / elapsed;
+  const int    left    = mTotal - mDone - mFailed;
+
+  QString text("%1/%2 (%3%), %4 failed, %5 MB, %6 chunks/s, ETA %7 min");
+  text = text.arg(mDone).arg(mTotal);
+  text = text.arg(mTotal ? 100.0 * (mDone + mFailed) / mTotal : 100.0, 0, 'f', 1);
+  text = text.arg(mFailed);
+  text = text.arg(mBytes / 1e6, 0, 'f', 1);
+  text = text.arg(rate, 0, 'f', 1);
+  text = text.arg(rate > 0 ? left / rate / 60 : 0.0, 0, 'f', 1);
+  qDebug() << "Seeding:" << text.toLatin1().constData();
+}
@@ -0,0 +1,78 @@
+#ifndef NAVIGINE_QT_CACHE_SEEDER_H
+#define NAVIGINE_QT_CACHE_SEEDER_H
+
+#include <QtCore/QtCore>
+#include <QtNetwork/QtNetwork>
+
+#include "TileEngine.h"
+
+// Fills the disk cache in advance for a region: a bounding box or a corridor
+// around a GPX track or a recorded log. Chunks are enumerated on the chunk grid
+// (see TileEngine::chunkHash), chunks already cached are skipped, so that an
+// interrupted run is resumed by running it again.
+class CacheSeeder: public QObject
+{
+    Q_OBJECT
+
+  public:
+    CacheSeeder(const QString& apiKey, const QString& cacheDir, QObject* parent = 0);
+
+    // Options: --box <lat1>,<lon1>,<lat2>,<lon2> | --track <file.gpx | recorded log>
+    //          [--corridor <meters>] [--zoom <min>-<max>] [--type <type>[,<type>...]]
+    //          [--jobs <count>] [--rate <requests per second>] [--dry-run]
+    // Box longitudes are the west and the east edges (lon1 > lon2 crosses the 180th meridian).
+    bool parseArguments(const QStringList& args);
+
+    // Enumerates chunks and prints the download estimate, returns false on errors
+    bool prepare();
+
+    bool isDryRun()const { return mDryRun; }
+
+  public slots:
+    void start();
+
+  private slots:
+    void onTimer();
+    void onRequestFinished(QNetworkReply* reply);
+
+  private:
+    struct Chunk
+    {
+      QString   type      = {};
+      int       zoom      = 0;
+      double    latitude  = 0.0;
+      double    longitude = 0.0;
+      QString   key       = {};
+      int       attempts  = 0;
+    };
+
+    bool loadTrack(const QString& fileName);
+    void addArea(const QRectF& area, int zoom, QSet<qint64>& cells)const;
+    void printProgress(bool force);
+
+    const QString                 mApiKey;
+    const QString                 mCacheDir;
+    QNetworkAccessManager*        mNetworkManager;
+    QTimer*                       mTimer;             // Rate limiting timer
+
+    QList<QRectF>                 mBoxes;             // Bounding box (two if it crosses the 180th meridian): x - longitude, y - latitude
+    QList<QPair<double,double> >  mTrack;             // Corridor track points (latitude, longitude)
+    double                        mCorridor;          // Corridor half-width (in meters)
+    int                           mZoomMin;
+    int                           mZoomMax;
+    QStringList                   mTypes;
+    int                           mJobs;              // Maximum number of parallel requests
+    double                        mRate;              // Maximum number of requests per second
+    bool                          mDryRun;
+
+    QList<Chunk>                  mQueue;             // Chunks to be downloaded
+    int                           mTotal;             // Number of chunks to be downloaded
+    QHash<QNetworkReply*,Chunk>   mRequests;          // Requests in progress
+    int                           mDone;
+    int                           mFailed;
+    qint64                        mBytes;             // Downloaded bytes
+    QDateTime                     mStartTime;
+    QDateTime                     mProgressTime;      // Time of the last progress report
+};
+
+#endif
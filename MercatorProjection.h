@@ -0,0 +1,111 @@
+#ifndef NAVIGINE_QT_MERCATOR_PROJECTION_H
+#define NAVIGINE_QT_MERCATOR_PROJECTION_H
+
+#include <math.h>
+
+#include <QtCore/QtCore>
+
+// Web Mercator projection, as used by the map tiles.
+// World pixel coordinates: (0, 0) is the north-west corner of the world,
+// the world is MERCATOR_WORLD_SIZE[zoom] pixels wide and high.
+
+const int         MERCATOR_ZOOM_MIN       = 0;
+const int         MERCATOR_ZOOM_MAX       = 21;
+constexpr double  MERCATOR_TILE_SIZE      = 256.0;              // World size on zoom level 0 (in pixels)
+constexpr double  MERCATOR_MAX_LATITUDE   = 85.0511287798066;   // Projection latitude limit
+constexpr double  MERCATOR_EQUATOR_LENGTH = 40075016.686;       // Equator length (in meters)
+
+constexpr double mercatorWorldSize(int zoom)
+{
+  return MERCATOR_TILE_SIZE * (double)(1LL << zoom);
+}
+
+// World size (in pixels) per zoom level
+constexpr double MERCATOR_WORLD_SIZE[MERCATOR_ZOOM_MAX + 1] = {
+    mercatorWorldSize(0),  mercatorWorldSize(1),  mercatorWorldSize(2),  mercatorWorldSize(3),
+    mercatorWorldSize(4),  mercatorWorldSize(5),  mercatorWorldSize(6),  mercatorWorldSize(7),
+    mercatorWorldSize(8),  mercatorWorldSize(9),  mercatorWorldSize(10), mercatorWorldSize(11),
+    mercatorWorldSize(12), mercatorWorldSize(13), mercatorWorldSize(14), mercatorWorldSize(15),
+    mercatorWorldSize(16), mercatorWorldSize(17), mercatorWorldSize(18), mercatorWorldSize(19),
+    mercatorWorldSize(20), mercatorWorldSize(21) };
+
+// Equator resolution (in meters per pixel) per zoom level
+constexpr double MERCATOR_RESOLUTION[MERCATOR_ZOOM_MAX + 1] = {
+    MERCATOR_EQUATOR_LENGTH / mercatorWorldSize(0),  MERCATOR_EQUATOR_LENGTH / mercatorWorldSize(1),
+    MERCATOR_EQUATOR_LENGTH / mercatorWorldSize(2),  MERCATOR_EQUATOR_LENGTH / mercatorWorldSize(3),
+    MERCATOR_EQUATOR_LENGTH / mercatorWorldSize(4),  MERCATOR_EQUATOR_LENGTH / mercatorWorldSize(5),
+    MERCATOR_EQUATOR_LENGTH / mercatorWorldSize(6),  MERCATOR_EQUATOR_LENGTH / mercatorWorldSize(7),
+    MERCATOR_EQUATOR_LENGTH / mercatorWorldSize(8),  MERCATOR_EQUATOR_LENGTH / mercatorWorldSize(9),
+    MERCATOR_EQUATOR_LENGTH / mercatorWorldSize(10), MERCATOR_EQUATOR_LENGTH / mercatorWorldSize(11),
+    MERCATOR_EQUATOR_LENGTH / mercatorWorldSize(12), MERCATOR_EQUATOR_LENGTH / mercatorWorldSize(13),
+    MERCATOR_EQUATOR_LENGTH / mercatorWorldSize(14), MERCATOR_EQUATOR_LENGTH / mercatorWorldSize(15),
+    MERCATOR_EQUATOR_LENGTH / mercatorWorldSize(16), MERCATOR_EQUATOR_LENGTH / mercatorWorldSize(17),
+    MERCATOR_EQUATOR_LENGTH / mercatorWorldSize(18), MERCATOR_EQUATOR_LENGTH / mercatorWorldSize(19),
+    MERCATOR_EQUATOR_LENGTH / mercatorWorldSize(20), MERCATOR_EQUATOR_LENGTH / mercatorWorldSize(21) };
+
+static_assert(MERCATOR_WORLD_SIZE[18] == 67108864.0, "Invalid Mercator world size table");
+
+inline double mercatorClampLatitude(double latitude)
+{
+  return qBound(-MERCATOR_MAX_LATITUDE, latitude, MERCATOR_MAX_LATITUDE);
+}
+
+// Longitude normalized to [-180, 180)
+inline double mercatorWrapLongitude(double longitude)
+{
+  return longitude - 360.0 * floor((longitude + 180.0) / 360.0);
+}
+
+// Meters per pixel at the given latitude
+inline double mercatorResolution(double latitude, int zoom)
+{
+  return MERCATOR_RESOLUTION[zoom] * cos(latitude * M_PI / 180);
+}
+
+// Geographic coordinates -> world pixel coordinates
+inline QPointF mercatorProject(double latitude, double longitude, int zoom)
+{
+  const double size = MERCATOR_WORLD_SIZE[zoom];
+  const double s    = sin(mercatorClampLatitude(latitude) * M_PI / 180);
+  return QPointF((longitude + 180) / 360 * size,
+                 (0.5 - log((1 + s) / (1 - s)) / (4 * M_PI)) * size);
+}
+
+// Geographic coordinates -> world pixel coordinates on the copy of the world
+// nearest to the reference point (the world repeats across the ±180° meridian)
+inline QPointF mercatorProjectNear(double latitude, double longitude, int zoom, const QPointF& reference)
+{
+  const double size = MERCATOR_WORLD_SIZE[zoom];
+  QPointF point = mercatorProject(latitude, longitude, zoom);
+  point.setX(point.x() - size * round((point.x() - reference.x()) / size));
+  return point;
+}
+
+// World pixel coordinates -> geographic coordinates
+inline void mercatorUnproject(const QPointF& point, int zoom, double& latitude, double& longitude)
+{
+  const double size = MERCATOR_WORLD_SIZE[zoom];
+  longitude = point.x() / size * 360 - 180;
+  latitude  = atan(sinh(M_PI * (1 - 2 * point.y() / size))) * 180 / M_PI;
+}
+
+// Batched transform of (latitude, longitude) points into screen coordinates:
+// screen = (world - origin) * scale. The loop has no branches and works on
+// contiguous arrays, so that the compiler can vectorize it.
+inline void mercatorProjectPoints(const QPair<double,double>* points, int count, int zoom,
+                                  const QPointF& origin, double scale, QPointF* result)
+{
+  const double kx = MERCATOR_WORLD_SIZE[zoom] / 360 * scale;
+  const double ky = MERCATOR_WORLD_SIZE[zoom] / (4 * M_PI) * scale;
+  const double bx = (MERCATOR_WORLD_SIZE[zoom] / 2 - origin.x()) * scale;
+  const double by = (MERCATOR_WORLD_SIZE[zoom] / 2 - origin.y()) * scale;
+
+  for(int i = 0; i < count; ++i)
+  {
+    const double s = sin(mercatorClampLatitude(points[i].first) * M_PI / 180);
+    result[i].setX(points[i].second * kx + bx);
+    result[i].setY(by - log((1 + s) / (1 - s)) * ky);
+  }
+}
+
+#endif
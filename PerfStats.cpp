@@ -0,0 +1,121 @@
+#include <algorithm>
+
+#include "PerfStats.h"
+
+const double  LATENCY_BOUNDS[]      = { 10, 20, 50, 100, 200, 500 };  // Latency histogram buckets (in milliseconds)
+const int     LATENCY_BOUNDS_COUNT  = sizeof(LATENCY_BOUNDS) / sizeof(LATENCY_BOUNDS[0]);
+const int     HISTOGRAM_WIDTH       = 20;                             // Histogram bar length (in characters)
+
+PerfSeries::PerfSeries(int capacity)
+  : mCapacity ( capacity )
+  , mNext     ( 0 )
+  , mTotal    ( 0 )
+{
+  mValues.reserve(capacity);
+}
+
+void PerfSeries::add(double value)
+{
+  if (mValues.size() < mCapacity)
+    mValues.append(value);
+  else
+    mValues[mNext] = value;
+  mNext = (mNext + 1) % mCapacity;
+  ++mTotal;
+}
+
+void PerfSeries::clear()
+{
+  mValues.clear();
+  mNext  = 0;
+  mTotal = 0;
+}
+
+double PerfSeries::percentile(double p)const
+{
+  if (mValues.isEmpty())
+    return 0.0;
+
+  QVector<double> values = mValues;
+  const int n = qBound(0, (int)(p / 100 * (values.size() - 1) + 0.5), values.size() - 1);
+  std::nth_element(values.begin(), values.begin() + n, values.end());
+  return values[n];
+}
+
+QVector<int> PerfSeries::histogram(const double* bounds, int count)const
+{
+  QVector<int> buckets(count + 1, 0);
+  for(int i = 0; i < mValues.size(); ++i)
+    ++buckets[std::upper_bound(bounds, bounds + count, mValues[i]) - bounds];
+  return buckets;
+}
+
+static QString hitRate(quint64 hits, quint64 total)
+{
+  if (total == 0)
+    return QString("-");
+  return QString("%1% (%2/%3)").arg(100.0 * hits / total, 0, 'f', 1).arg(hits).arg(total);
+}
+
+QString PerfStats::report()const
+{
+  const quint64 requests = memoryHits + sharedHits + diskHits + diskMisses;
+
+  QString text;
+  text += QString("Paint ms   : p50 %1, p90 %2, p99 %3, max %4\n")
+            .arg(paintTime.percentile(50), 0, 'f', 1)
+            .arg(paintTime.percentile(90), 0, 'f', 1)
+            .arg(paintTime.percentile(99), 0, 'f', 1)
+            .arg(paintTime.percentile(100), 0, 'f', 1);
+  text += QString("CPU load   : %1%\n").arg(cpuLoad, 0, 'f', 1);
+  text += QString("Composite  : p50 %1, p90 %2, max %3 ms, %4 bands\n")
+            .arg(compositeTime.percentile(50), 0, 'f', 1)
+            .arg(compositeTime.percentile(90), 0, 'f', 1)
+            .arg(compositeTime.percentile(100), 0, 'f', 1)
+            .arg(compositeBands);
+  text += QString("Tiles      : %1 visible, %2 missing, %3 in flight\n")
+            .arg(tilesVisible).arg(tilesMissing).arg(tilesInFlight);
+  text += QString("Startup    : %1 ms to complete frame, %2 chunks preloaded\n")
+            .arg(startupTime, 0, 'f', 0)
+            .arg(warmTiles);
+  text += QString("Mem cache  : %1, %2 shared\n").arg(hitRate(memoryHits + sharedHits, requests)).arg(sharedHits);
+  text += QString("Disk cache : %1\n").arg(hitRate(diskHits, diskHits + diskMisses));
+  text += QString("Net errors : %1, %2 requests collapsed\n").arg(networkErrors).arg(collapsed);
+  text += QString("Revalidate : %1 not modified, %2 replaced\n").arg(notModified).arg(replaced);
+  text += QString("Disk write : %1 queued, %2 dropped, %3 failed, p50 %4 ms, max %5 ms\n")
+            .arg(writeQueue)
+            .arg(writesDropped)
+            .arg(writesFailed)
+            .arg(writeTime.percentile(50), 0, 'f', 1)
+            .arg(writeTime.percentile(100), 0, 'f', 1);
+  text += QString("Decode ms  : p50 %1, p90 %2, max %3\n")
+            .arg(decodeTime.percentile(50), 0, 'f', 1)
+            .arg(decodeTime.percentile(90), 0, 'f', 1)
+            .arg(decodeTime.percentile(100), 0, 'f', 1);
+  text += QString("Telemetry  : %1 samples/s, %2 total\n")
+            .arg(sampleRate, 0, 'f', 1)
+            .arg(samples);
+  text += QString("Receiver   : %1 received, %2 invalid\n")
+            .arg(received)
+            .arg(invalid);
+  text += QString("Latency ms : p50 %1, p90 %2, p99 %3\n")
+            .arg(latency.percentile(50), 0, 'f', 1)
+            .arg(latency.percentile(90), 0, 'f', 1)
+            .arg(latency.percentile(99), 0, 'f', 1);
+
+  // Latency histogram: one bar per bucket, scaled to the largest bucket
+  const QVector<int> buckets = latency.histogram(LATENCY_BOUNDS, LATENCY_BOUNDS_COUNT);
+  const int maxCount = std::max(1, *std::max_element(buckets.begin(), buckets.end()));
+  for(int i = 0; i < buckets.size(); ++i)
+  {
+    const QString label = (i < LATENCY_BOUNDS_COUNT) ?
+                          QString("<%1").arg(LATENCY_BOUNDS[i]) :
+                          QString(">=%1").arg(LATENCY_BOUNDS[LATENCY_BOUNDS_COUNT - 1]);
+    const int len = (buckets[i] * HISTOGRAM_WIDTH + maxCount - 1) / maxCount;
+    text += QString("  %1 |%2 %3\n")
+              .arg(label, -6)
+              .arg(QString(len, QChar('#')), -HISTOGRAM_WIDTH)
+              .arg(buckets[i]);
+  }
+  return text;
+}
@@ -0,0 +1,69 @@
+#ifndef NAVIGINE_QT_PERF_STATS_H
+#define NAVIGINE_QT_PERF_STATS_H
+
+#include <QtCore/QtCore>
+
+// Series of the latest measurements (in milliseconds)
+class PerfSeries
+{
+  public:
+    PerfSeries(int capacity = 512);
+
+    void    add(double value);
+    void    clear();
+    int     size()const   { return mValues.size(); }
+    quint64 total()const  { return mTotal; }
+
+    // Percentile (0..100) of the stored measurements
+    double  percentile(double p)const;
+
+    // Number of stored measurements below each of the bounds,
+    // the last bucket counts the rest
+    QVector<int> histogram(const double* bounds, int count)const;
+
+  private:
+    QVector<double>   mValues;    // Ring buffer
+    int               mCapacity;
+    int               mNext;      // Next position to be written
+    quint64           mTotal;     // Number of measurements since start
+};
+
+// Performance counters of the map widget (tile counters are totals of the shared engine)
+struct PerfStats
+{
+  PerfSeries  paintTime;              // paintEvent duration
+  PerfSeries  compositeTime;          // Map layer compositing duration (frames with map changes only)
+  PerfSeries  decodeTime;             // Chunk image decoding time (disk and network)
+  PerfSeries  latency;                // Telemetry end-to-end latency
+  PerfSeries  writeTime;              // Chunk write-behind latency (queued to renamed)
+
+  int         tilesVisible    = 0;    // Chunks drawn by the last paintEvent
+  int         compositeBands  = 0;    // Bands of the last map layer compositing
+  int         tilesMissing    = 0;    // Uncovered areas found by the last base layer refresh
+  int         tilesInFlight   = 0;    // Network requests in progress
+  int         warmTiles       = 0;    // Chunks preloaded at startup
+  double      startupTime     = 0.0;  // Time to the first fully covered frame (in milliseconds)
+
+  quint64     memoryHits      = 0;    // Chunk requests served from the view memory
+  quint64     sharedHits      = 0;    // Chunk requests served from the shared engine memory
+  quint64     diskHits        = 0;    // Chunk requests served from disk cache
+  quint64     diskMisses      = 0;    // Chunk requests sent to the network
+  quint64     collapsed       = 0;    // Chunk requests joined to the request in progress
+  quint64     networkErrors   = 0;
+  quint64     notModified     = 0;    // Stale chunks revalidated with 304 Not Modified
+  quint64     replaced        = 0;    // Stale chunks downloaded again
+  int         writeQueue      = 0;    // Chunks waiting to be written to disk
+  quint64     writesDropped   = 0;    // Writes cancelled by eviction before flushing
+  quint64     writesFailed    = 0;
+
+  quint64     samples         = 0;    // Telemetry samples processed
+  double      sampleRate      = 0.0;  // Telemetry samples per second (updated periodically)
+  double      cpuLoad         = 0.0;  // Process CPU usage, all threads (percent of one core, updated periodically)
+  quint64     received        = 0;    // Samples received from telemetry sockets
+  quint64     invalid         = 0;    // Invalid datagrams and lines
+
+  // Human-readable report, one counter per line
+  QString report()const;
+};
+
+#endif
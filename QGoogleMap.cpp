@@ -1,41 +1,92 @@
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <utime.h>
 #include <signal.h>
 
+#include <algorithm>
+
 #include "QGoogleMap.h"
+#include "CacheSeeder.h"
 
 const int     MEM_CACHE_SIZE  = 200;    // In chunks
-const int     DISK_CACHE_SIZE = 10000;  // In chunks
 const int     HISTORY_SIZE    = 1000;   // maximum history (track) size
-const int     ZOOM_MAX        = 19;     // maximum zoom value
-const int     ZOOM_MIN        = 10;     // minimum zoom value
+const int     ZOOM_MAX        = MERCATOR_ZOOM_MAX;  // maximum zoom value
+const int     ZOOM_MIN        = MERCATOR_ZOOM_MIN;  // minimum zoom value
 const double  EPSILON         = 1e-8;
 
-const double DEG_LENGTH_ARRAY[] = {
-    0,            // Zoom level 0
-    0,            // Zoom level 1
-    0,            // Zoom level 2
-    0,            // Zoom level 3
-    0,            // Zoom level 4
-    22.8,         // Zoom level 5
-    0,            // Zoom level 6
-    0,            // Zoom level 7
-    0,            // Zoom level 8
-    0,            // Zoom level 9
-    727.142857,   // Zoom level 10
-    1454.285714,  // Zoom level 11
-    2908.571428,  // Zoom level 12
-    0,            // Zoom level 13
-    0,            // Zoom level 14
-    0,            // Zoom level 15
-    46625.0,      // Zoom level 16
-    93250.0,      // Zoom level 17
-    186500.0,     // Zoom level 18
-    373000.0,     // Zoom level 19
-    0 };          // Zoom level 20
+const int     PRIMARY_TARGET_ID     = 0;      // own device target id
+const double  TARGET_INDEX_CELL     = 0.01;   // spatial index cell size (in degrees)
+const int     CLUSTER_ZOOM          = 16;     // targets are clustered below this zoom level
+const int     CLUSTER_SIZE          = 64;     // cluster cell size (in pixels)
+const int     FLEET_MARKER_RADIUS   = 8;      // fleet target marker radius (in pixels)
+const int     TELEMETRY_BATCH_SIZE  = 4096;   // maximum number of samples processed at once
+
+const double  METERS_PER_DEG        = 40000000.0 / 360; // length of 1 degree meridian (in meters)
+const double  DR_MAX_TIME           = 1.0;    // maximum dead-reckoning extrapolation (in seconds)
+const double  DR_CORRECTION_TIME    = 0.15;   // time constant of the fix correction decay (in seconds)
+const double  DR_VELOCITY_GAIN      = 0.5;    // velocity estimate smoothing gain
+const double  DR_MIN_VELOCITY       = 0.5;    // targets slower than this are parked (m/s)
+const double  DR_MIN_ERROR          = 1.0;    // prediction errors below this (or the fix accuracy) are not animated (m)
+const double  DR_MIN_AZIMUTH_ERROR  = 2.0;    // heading prediction errors below this are not animated (degrees)
+const int     FRAME_INTERVAL        = 16;     // animation frame interval (in milliseconds)
+const int     REFRESH_DELAY         = 50;     // refresh coalescing delay (in milliseconds)
+const int     RETRY_INTERVAL        = 2000;   // failed chunk retry delay (in milliseconds)
+const int     ADJUST_DELAY          = 5000;   // adjust mode pause after manual scroll (in milliseconds)
+const double  ZOOM_TIME             = 0.08;   // zoom animation time constant (in seconds)
+const double  ZOOM_EPSILON          = 1e-3;   // zoom animation precision (in zoom levels)
+const double  FOLLOW_TIME           = 0.1;    // camera follow time constant (in seconds)
+const double  PAN_FRICTION_TIME     = 0.3;    // kinetic pan decay time constant (in seconds)
+const double  PAN_MIN_VELOCITY      = 20.0;   // kinetic pan stops below this velocity (pixels per second)
+const double  PAN_RELEASE_TIME      = 0.1;    // no kinetic pan if mouse stopped before release (in seconds)
+const int     PERF_UPDATE_INTERVAL  = 1000;   // performance panel update interval (in milliseconds)
+const int     PERF_DUMP_INTERVAL    = 10000;  // performance counters dump interval (in milliseconds)
+const int     WARM_TILES            = 64;     // maximum number of chunks preloaded at startup
+const int     MAP_BAND_MIN_HEIGHT   = 64;     // minimum height of a map layer compositing band (in pixels)
 
 const QString FFMPEG = "ffmpeg";
+const QString HOME_DIR = "/var/tmp/QGoogleMap";
+
+// Scale bar steps (in meters)
+const double SCALE_STEPS[] = {
+    1e0, 2e0, 3e0, 4e0, 5e0, 6e0, 7e0, 8e0, 9e0,
+    1e1, 2e1, 3e1, 4e1, 5e1, 6e1, 7e1, 8e1, 9e1,
+    1e2, 2e2, 3e2, 4e2, 5e2, 6e2, 7e2, 8e2, 9e2,
+    1e3, 2e3, 3e3, 4e3, 5e3, 6e3, 7e3, 8e3, 9e3,
+    1e4, 2e4, 3e4, 4e4, 5e4, 6e4, 7e4, 8e4, 9e4,
+    1e5, 2e5, 3e5, 4e5, 5e5, 6e5, 7e5, 8e5, 9e5,
+    1e6, 2e6, 3e6, 4e6, 5e6, 6e6, 7e6, 8e6, 9e6 };
+
+const int SCALE_STEPS_COUNT = sizeof(SCALE_STEPS) / sizeof(SCALE_STEPS[0]);
+
+// Supported map types, each one is cached independently (in memory and on disk)
+const QStringList MAP_TYPES = QStringList() << "roadmap" << "satellite" << "terrain" << "hybrid";
+
+static double getTimeStamp()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Process CPU time, all threads (in seconds)
+static double getCpuTime()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-6;
+}
+
+// IPv4 address of the wireless interface shown on the info panel
+static QString getWlanAddress()
+{
+  const QList<QNetworkAddressEntry> addresses = QNetworkInterface::interfaceFromName("wlan0").addressEntries();
+  for(int i = 0; i < addresses.size(); ++i)
+    if (addresses[i].ip().protocol() == QAbstractSocket::IPv4Protocol)
+      return addresses[i].ip().toString();
+  return QString();
+}
+
 
 StdinReader::StdinReader(QObject* parent)
   : QThread ( parent )
@@ -46,86 +97,142 @@ StdinReader::StdinReader(QObject* parent)
 
 void StdinReader::run()
 {
+  traceSetThreadName("stdin");
+  
+  // Reading blocks until a line arrives, the thread ends when stdin is closed
   while (true)
   {
     QString line = mStream.readLine();
+    if (line.isNull())
+      break;
     if (line.isEmpty())
-    {
-      usleep(100000);
       continue;
-    }
+    
+    // Telemetry line span: read -> parse -> setTarget -> paint
+    if (traceEnabled())
+      traceEvent("telemetry", "telemetry", 'b', qHash(line));
     
     emit readLine(line);
   }
 }
 
-CacheCleaner::CacheCleaner(const QString& cacheDir, QObject* parent)
-  : QThread   ( parent )
-  , mCacheDir ( cacheDir )
+QGoogleMap::QGoogleMap(const QString& apiKey, QWidget* parent)
+  : QGoogleMap ( TileEngine::instance(apiKey), parent )
 {
-  setTerminationEnabled(true);
 }
 
-void CacheCleaner::run()
+QGoogleMap::QGoogleMap(TileEngine* engine, QWidget* parent)
+  : QGoogleMap ( engine, HOME_DIR, parent )
 {
-  while (true)
-  {
-    QDir dir(mCacheDir);
-    QStringList fileList = dir.entryList(QStringList() << "*.png", QDir::Files, QDir::Time);
-    
-    if (fileList.size() > DISK_CACHE_SIZE)
-    {
-      while (fileList.size() > DISK_CACHE_SIZE / 2)
-      {
-        qDebug() << "Removing file" << fileList.last();
-        dir.remove(fileList.last());
-        fileList.removeLast();
-      }
-    }
-    usleep(60000000);
-  }
 }
 
-QGoogleMap::QGoogleMap(const QString& apiKey, QWidget* parent)
+QGoogleMap::QGoogleMap(TileEngine* engine, const QString& homeDir, QWidget* parent)
   : QWidget          ( parent )
-  , mApiKey          ( apiKey )
-  , mHomeDir         ( "/var/tmp/QGoogleMap" )
+  , mEngine          ( engine )
+  , mHomeDir         ( homeDir )
   , mMapType         ( "roadmap" )
+  , mOverlayType     ( "satellite" )
+  , mOverlayOpacity  ( 0.0 )
+  , mOverlayPrefetch ( true )
   , mMapZoom         ( 18  )
-  , mDegLength       ( DEG_LENGTH_ARRAY[mMapZoom] )
+  , mZoom            ( mMapZoom )
+  , mZoomTarget      ( mMapZoom )
+  , mScale           ( 1.0 )
   , mLatitude        ( 42.531  )
   , mLongitude       ( -71.149 )
-  , mTargetLatitude  ( 0.0 )
-  , mTargetLongitude ( 0.0 )
-  , mTargetAccuracy  ( 0.0 )
   , mAdjustTime      ( QDateTime::currentDateTime() )
   , mGpsTime         ( QDateTime::currentDateTime() )
+  , mScaleValue      ( 0.0 )
+  , mScaleText0Width ( 0 )
+  , mScaleText2Width ( 0 )
+  , mScaleTextOffset ( 0 )
+  , mPerfVisible     ( false )
+  , mPerfTime        ( getTimeStamp() )
+  , mPerfDumpTime    ( mPerfTime )
+  , mPerfSamples     ( 0 )
+  , mPerfCpuTime     ( getCpuTime() )
+  , mStartTime       ( getTimeStamp() )
+  , mTelemetrySources ( 0 )
+  , mLastMoveTime    ( 0.0 )
+  , mFrameTime       ( 0.0 )
+  , mMoveTime        ( 0.0 )
+  , mDragging        ( false )
   , mRecordProcess   ( 0 )
 {
+  mOverlayFont = font();
+  mOverlayFont.setFamily("Courier New");
+  traceSetThreadName("gui");
+  
   mkdir(qPrintable(mHomeDir), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
-  mkdir(qPrintable(mHomeDir + "/cache"), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
   mkdir(qPrintable(mHomeDir + "/video"), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
   mkdir(qPrintable(mHomeDir + "/logs"),  S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
   
-  mNetworkManager = new QNetworkAccessManager(this);
-  connect(mNetworkManager, SIGNAL(finished(QNetworkReply*)), this, SLOT(onRequestFinished(QNetworkReply*)));
+  // Map layer compositing has its own threads, so it never waits for the warm start decoding
+  // on the global pool. Threads are kept: every new thread would get its own trace buffer.
+  mCompositePool = new QThreadPool(this);
+  mCompositePool->setExpiryTimeout(-1);
+  
+  // Warm start: the last viewport is restored and its chunks are decoded in parallel
+  mWarmWatcher = new QFutureWatcher<MapChunk>(this);
+  connect(mWarmWatcher, SIGNAL(resultReadyAt(int)), this, SLOT(onWarmChunk(int)));
+  connect(QCoreApplication::instance(), SIGNAL(aboutToQuit()), this, SLOT(saveState()));
+  
+  // State file is named after objectName(), which is set after construction
+  QTimer::singleShot(0, this, SLOT(loadState()));
+  
+  connect(mEngine, SIGNAL(chunkReady(QString,MapChunk)), this, SLOT(onChunkReady(QString,MapChunk)));
+  connect(mEngine, SIGNAL(chunkFailed(QString)), this, SLOT(onChunkFailed(QString)));
+  
+  // Refresh is driven by state changes (see scheduleRefresh), not polled
+  mRefreshTimer = new QTimer(this);
+  mRefreshTimer->setInterval(REFRESH_DELAY);
+  mRefreshTimer->setSingleShot(true);
+  connect(mRefreshTimer, SIGNAL(timeout()), this, SLOT(refresh()));
+  scheduleRefresh();
   
-  mNetworkTimeoutSignalMapper = new QSignalMapper(this);
-  connect(mNetworkTimeoutSignalMapper, SIGNAL(mapped(QObject*)),
-          this, SLOT(onRequestTimeout(QObject*)));
+  mAdjustTimer = new QTimer(this);
+  mAdjustTimer->setInterval(ADJUST_DELAY + 100);
+  mAdjustTimer->setSingleShot(true);
+  connect(mAdjustTimer, SIGNAL(timeout()), this, SLOT(scheduleRefresh()));
   
-  QTimer* refreshTimer = new QTimer(this);
-  refreshTimer->setInterval(250);
-  refreshTimer->setSingleShot(false);
-  refreshTimer->start();
-  connect(refreshTimer, SIGNAL(timeout()), this, SLOT(refresh()));
+  mFrameTimer = new QTimer(this);
+  mFrameTimer->setInterval(FRAME_INTERVAL);
+  mFrameTimer->setSingleShot(false);
+  connect(mFrameTimer, SIGNAL(timeout()), this, SLOT(onFrame()));
   
-  mReader = new StdinReader(this);
+  // Counters are dumped for monitoring even if the panel is hidden
+  mPerfTimer = new QTimer(this);
+  mPerfTimer->setInterval(PERF_DUMP_INTERVAL);
+  connect(mPerfTimer, SIGNAL(timeout()), this, SLOT(onPerfUpdate()));
+  mPerfTimer->start();
+  mWlanAddress = getWlanAddress();
+  
+  // Own device telemetry is read once and shared by all views (never deleted: the thread can't be stopped)
+  static StdinReader* reader = 0;
+  if (!reader)
+  {
+    reader = new StdinReader;
+    reader->start();
+  }
+  mReader = reader;
   connect(mReader, SIGNAL(readLine(QString)), this, SLOT(onReadLine(QString)));
-  mReader->start();
   
-  mCacheCleaner = new CacheCleaner(mHomeDir + "/cache", this);
-  mCacheCleaner->start();
+  // Own device track is recorded by the first view of the home directory, the last part of it is shown at once
+  static QHash<QString,TrackStore*> trackStores;
+  TrackStore*& trackStore = trackStores[mHomeDir];
+  mTrackRecorder = !trackStore;
+  if (!trackStore)
+  {
+    trackStore = new TrackStore;
+    trackStore->open(mHomeDir + "/tracks");
+  }
+  mTrackStore = trackStore;
+  restoreTrack();
+  
+  // Sockets are added by addTelemetrySource() before the event loop starts
+  mTelemetryReceiver = new TelemetryReceiver(this);
+  connect(mTelemetryReceiver, SIGNAL(samplesReady()), this, SLOT(onTelemetrySamples()));
+  QTimer::singleShot(0, this, SLOT(onTelemetryStart()));
   
   mZoomInButton = new QToolButton(this);
   mZoomInButton->setStyleSheet("background-color: rgba(200,200,200,200); border-style: solid; border-radius: 30px;");
@@ -160,43 +267,527 @@ QGoogleMap::QGoogleMap(const QString& apiKey, QWidget* parent)
   connect(mRecordButton, SIGNAL(toggled(bool)), this, SLOT(onRecordToggle()));
 }
 
+static bool isValidLocation(double latitude, double longitude)
+{
+  return (qAbs(latitude)  > EPSILON || qAbs(longitude) > EPSILON) &&
+          qAbs(latitude)  <= 89.0 &&
+          qAbs(longitude) <= 180.0;
+}
+
+static qint64 targetCell(double latitude, double longitude)
+{
+  const qint32 y = (qint32)floor(latitude  / TARGET_INDEX_CELL);
+  const qint32 x = (qint32)floor(longitude / TARGET_INDEX_CELL);
+  return ((qint64)y << 32) | (quint32)x;
+}
+
+static void removeFromIndex(QHash<qint64,QSet<int> >& index, qint64 cell, int id)
+{
+  auto iter = index.find(cell);
+  if (iter != index.end())
+  {
+    iter.value().remove(id);
+    if (iter.value().isEmpty())
+      index.erase(iter);
+  }
+}
+
+// Dead-reckoning: position of the target at the given time, extrapolated from
+// the last fix with the estimated velocity. The difference between prediction
+// and the new fix is decayed smoothly, so that the marker never jumps.
+static QPair<double,double> predictTarget(const MapTarget& target, double time)
+{
+  const double dt    = qBound(0.0, time - target.fixTime, DR_MAX_TIME);
+  const double decay = exp(-qMax(0.0, time - target.fixTime) / DR_CORRECTION_TIME);
+  const double north = target.velocityN * dt + target.offsetN * decay;
+  const double east  = target.velocityE * dt + target.offsetE * decay;
+  return qMakePair(target.latitude  + north / METERS_PER_DEG,
+                   target.longitude + east  / METERS_PER_DEG / cos(target.latitude * M_PI / 180));
+}
+
+// Heading difference normalized to [-180, 180)
+static double azimuthDelta(double a, double b)
+{
+  return a - b - 360.0 * floor((a - b + 180.0) / 360.0);
+}
+
+// Heading is extrapolated with the estimated turn rate the same way as the position
+static double predictAzimuth(const MapTarget& target, double time)
+{
+  const double dt    = qBound(0.0, time - target.fixTime, DR_MAX_TIME);
+  const double decay = exp(-qMax(0.0, time - target.fixTime) / DR_CORRECTION_TIME);
+  return target.azimuth + target.turnRate * dt + target.offsetA * decay;
+}
+
 void QGoogleMap::setTarget(double latitude, double longitude, double accuracy, double azimuth)
 {
-  mTargetLatitude  = latitude;
-  mTargetLongitude = longitude;
-  mTargetAccuracy  = accuracy;
-  mTargetAzimuth   = azimuth;
+  setTarget(PRIMARY_TARGET_ID, latitude, longitude, accuracy, azimuth);
+}
+
+void QGoogleMap::setTarget(int id, double latitude, double longitude, double accuracy, double azimuth)
+{
+  updateTarget(id, latitude, longitude, accuracy, azimuth, -1.0, getTimeStamp());
+  
+  if (id == PRIMARY_TARGET_ID)
+    scheduleRefresh();
+  update();
+}
+
+bool QGoogleMap::updateTarget(int id, double latitude, double longitude, double accuracy, double azimuth,
+                              double velocity, double time)
+{
+  MapTarget& target = mTargets[id];
+  const bool changed = target.latitude != latitude || target.longitude != longitude ||
+                       target.accuracy != accuracy || target.azimuth   != azimuth;
+  
+  // Updating spatial index
+  const bool indexed = isValidLocation(target.latitude, target.longitude);
+  const bool valid   = isValidLocation(latitude, longitude);
+  const qint64 cell  = valid ? targetCell(latitude, longitude) : 0;
+  
+  if (indexed && (!valid || cell != target.cell))
+    removeFromIndex(mTargetIndex, target.cell, id);
+  if (valid && (!indexed || cell != target.cell))
+    mTargetIndex[cell].insert(id);
+  
+  // Updating motion estimate
+  if (valid && indexed && target.fixTime > EPSILON)
+  {
+    const double dt   = time - target.fixTime;
+    const double coef = cos(latitude * M_PI / 180);
+    const QPair<double,double> predicted = predictTarget(target, time);
+    
+    target.offsetN = (predicted.first  - latitude)  * METERS_PER_DEG;
+    target.offsetE = (predicted.second - longitude) * METERS_PER_DEG * coef;
+    target.error   = sqrt(target.offsetN * target.offsetN + target.offsetE * target.offsetE);
+    target.offsetA = azimuthDelta(predictAzimuth(target, time), azimuth);
+    
+    if (dt > EPSILON && dt < DR_MAX_TIME)
+    {
+      // Constant-velocity model: velocity from consecutive fixes,
+      // blended with the reported velocity (m/s) and heading if available
+      double vN = (latitude  - target.latitude)  * METERS_PER_DEG / dt;
+      double vE = (longitude - target.longitude) * METERS_PER_DEG * coef / dt;
+      if (velocity >= 0.0)
+      {
+        vN = (vN + velocity * cos(azimuth * M_PI / 180)) / 2;
+        vE = (vE + velocity * sin(azimuth * M_PI / 180)) / 2;
+      }
+      target.velocityN += DR_VELOCITY_GAIN * (vN - target.velocityN);
+      target.velocityE += DR_VELOCITY_GAIN * (vE - target.velocityE);
+      target.turnRate  += DR_VELOCITY_GAIN * (azimuthDelta(azimuth, target.azimuth) / dt - target.turnRate);
+    }
+    else if (dt >= DR_MAX_TIME)
+    {
+      target.velocityN = 0.0;
+      target.velocityE = 0.0;
+      target.turnRate  = 0.0;
+    }
+  }
+  else
+  {
+    target.velocityN = 0.0;
+    target.velocityE = 0.0;
+    target.turnRate  = 0.0;
+    target.offsetN   = 0.0;
+    target.offsetE   = 0.0;
+    target.offsetA   = 0.0;
+    target.error     = 0.0;
+  }
+  target.fixTime = time;
   
-  if (hasTarget())
+  // Jumps within the fix accuracy are GPS jitter. A target moving slower than the jitter
+  // is parked: it is drawn at the fix without animation, so it never wakes the frame timer.
+  // Reported velocity is trusted, the estimated one is as noisy as the fixes.
+  const double jitter   = qMax(DR_MIN_ERROR, accuracy);
+  const double speed    = (velocity >= 0.0) ? velocity : sqrt(target.velocityN * target.velocityN +
+                                                               target.velocityE * target.velocityE);
+  const double minSpeed = (velocity >= 0.0) ? DR_MIN_VELOCITY : qMax(DR_MIN_VELOCITY, jitter / DR_MAX_TIME);
+  if (indexed && target.error <= jitter && speed < minSpeed)
+  {
+    target.velocityN = 0.0;
+    target.velocityE = 0.0;
+    target.turnRate  = 0.0;
+    target.offsetN   = 0.0;
+    target.offsetE   = 0.0;
+    target.offsetA   = 0.0;
+  }
+  else if (valid && (!indexed || target.error > jitter || qAbs(target.offsetA) > DR_MIN_AZIMUTH_ERROR ||
+                     speed >= minSpeed))
   {
-    mTargetHistory.append(qMakePair(mTargetLatitude, mTargetLongitude));
-    if (mTargetHistory.size() > HISTORY_SIZE)
-      mTargetHistory.removeFirst();
+    // Animating until the prediction settles
+    mLastMoveTime = qMax(mLastMoveTime, time);
+    requestFrame();
   }
   
-  refresh();
+  target.id        = id;
+  target.latitude  = latitude;
+  target.longitude = longitude;
+  target.accuracy  = accuracy;
+  target.azimuth   = azimuth;
+  target.cell      = cell;
+  
+  if (valid)
+  {
+    target.history.append(qMakePair(latitude, longitude));
+    if (target.history.size() > HISTORY_SIZE)
+      target.history.remove(0);
+  }
+  return changed;
+}
+
+QString QGoogleMap::stateFile()const
+{
+  if (objectName().isEmpty())
+    return mHomeDir + "/state.ini";
+  return QString("%1/state-%2.ini").arg(mHomeDir).arg(objectName());
+}
+
+void QGoogleMap::loadState()
+{
+  QSettings settings(stateFile(), QSettings::IniFormat);
+  if (!settings.contains("zoom"))
+    return;
+  
+  mLatitude       = mercatorClampLatitude(settings.value("latitude", mLatitude).toDouble());
+  mLongitude      = settings.value("longitude", mLongitude).toDouble();
+  mMapZoom        = qBound(ZOOM_MIN, settings.value("zoom", mMapZoom).toInt(), ZOOM_MAX);
+  mZoom           = mMapZoom;
+  mZoomTarget     = mMapZoom;
+  mOverlayOpacity = settings.value("overlay_opacity", mOverlayOpacity).toDouble();
+  
+  const QString mapType     = settings.value("map_type").toString();
+  const QString overlayType = settings.value("overlay_type").toString();
+  if (MAP_TYPES.contains(mapType) && MAP_TYPES.contains(overlayType) && mapType != overlayType)
+  {
+    mMapType     = mapType;
+    mOverlayType = overlayType;
+  }
+  
+  // Placeholders keep refresh() from loading the same chunks synchronously
+  mWarmKeys = settings.value("tiles").toStringList();
+  QStringList fileNames;
+  for(int i = 0; i < mWarmKeys.size(); ++i)
+  {
+    mMapChunks.insert(mWarmKeys[i], MapChunk());
+    fileNames.append(mEngine->chunkFile(mWarmKeys[i]));
+  }
+  mWarmWatcher->setFuture(QtConcurrent::mapped(fileNames, TileEngine::decodeChunk));
+  
+  mZoomInButton->setEnabled(mMapZoom < ZOOM_MAX);
+  mZoomOutButton->setEnabled(mMapZoom > ZOOM_MIN);
+  scheduleRefresh();
+  update();
+  
+  qDebug() << "Restored viewport" << mLatitude << mLongitude << mMapZoom << ", preloading" << mWarmKeys.size() << "chunks";
+}
+
+void QGoogleMap::restoreTrack()
+{
+  const QVector<TrackRecord> records = mTrackStore->tail(HISTORY_SIZE);
+  if (records.isEmpty())
+    return;
+  
+  // History only: the last recorded position may be days old, the target appears with the first fix
+  MapTarget& target = mTargets[PRIMARY_TARGET_ID];
+  target.id = PRIMARY_TARGET_ID;
+  target.history.resize(records.size());
+  for(int i = 0; i < records.size(); ++i)
+    target.history[i] = qMakePair(records[i].latitude, records[i].longitude);
+  
+  qDebug() << "Restored track of" << records.size() << "points";
+}
+
+void QGoogleMap::saveState()
+{
+  // Track of the last seconds is not synced yet (the store is never closed)
+  if (mTrackRecorder)
+    mTrackStore->sync();
+  
+  QSettings settings(stateFile(), QSettings::IniFormat);
+  settings.setValue("latitude",         mLatitude);
+  settings.setValue("longitude",        mLongitude);
+  settings.setValue("zoom",             (int)floor(mZoomTarget + 0.5));
+  settings.setValue("map_type",         mMapType);
+  settings.setValue("overlay_type",     mOverlayType);
+  settings.setValue("overlay_opacity",  mOverlayOpacity);
+  
+  // Hot chunks: decoded chunks of the current zoom level, the nearest to the center first
+  const QPointF center = mercatorProject(mLatitude, mLongitude, mMapZoom);
+  QList<QPair<double,QString> > chunks;
+  for(auto iter = mMapChunks.constBegin(); iter != mMapChunks.constEnd(); ++iter)
+  {
+    const MapChunk& chunk = iter.value();
+    if (chunk.zoom != mMapZoom || chunk.image.isNull())
+      continue;
+    const QPointF delta = mercatorProjectNear(chunk.latitude, chunk.longitude, mMapZoom, center) - center;
+    chunks.append(qMakePair(delta.x() * delta.x() + delta.y() * delta.y(), iter.key()));
+  }
+  std::sort(chunks.begin(), chunks.end());
+  
+  QStringList keys;
+  for(int i = 0; i < chunks.size() && i < WARM_TILES; ++i)
+    keys.append(chunks[i].second);
+  settings.setValue("tiles", keys);
+  settings.sync();
+}
+
+void QGoogleMap::onWarmChunk(int index)
+{
+  const QString& key = mWarmKeys[index];
+  const MapChunk chunk = mWarmWatcher->resultAt(index);
+  
+  // Placeholder is gone if the chunk was dropped meanwhile (cache cleared, map type changed,
+  // evicted after zooming), or already filled by the engine
+  auto iter = mMapChunks.find(key);
+  if (iter == mMapChunks.end() || !iter.value().image.isNull())
+    return;
+  
+  // Failed chunks are loaded again by refresh()
+  if (chunk.image.isNull())
+  {
+    mMapChunks.erase(iter);
+    scheduleRefresh();
+    return;
+  }
+  
+  iter.value() = chunk;
+  mEngine->addChunk(key, chunk);
+  ++mPerf.warmTiles;
   update();
 }
 
+bool QGoogleMap::addTelemetrySource(const QString& spec)
+{
+  // Source ids are assigned in order, 0 is reserved for stdin
+  return mTelemetryReceiver->addSource(spec, ++mTelemetrySources);
+}
+
+void QGoogleMap::onTelemetryStart()
+{
+  if (mTelemetrySources > 0)
+    mTelemetryReceiver->start();
+}
+
 void QGoogleMap::setInfoText(const QString& text)
 {
+  if (text == mInfoText)
+    return;
   mInfoText = text;
+  prepareInfoPanel();
+  update();
+}
+
+void QGoogleMap::prepareInfoPanel()
+{
+  mInfoLines.clear();
+  mInfoLineTops.clear();
+  mInfoSize = QSize();
+  
+  if (mInfoText.isEmpty())
+    return;
+  
+  QStringList lines = mInfoText.split("\n");
+  
+  QFontMetrics fm(mOverlayFont);
+  int fh = fm.height();
+  int rh = lines.size() * (fh + 1);
+  int rw = 0;
+  
+  for(int i = 0; i < lines.size(); ++i)
+  {
+    QStaticText line(lines[i]);
+    line.setTextFormat(Qt::PlainText);
+    line.prepare(QTransform(), mOverlayFont);
+    
+    rw = qMax(rw, fm.width(lines[i]) + 10);
+    mInfoLines.append(line);
+    mInfoLineTops.append((i + 1) * (fh + 1) - fm.ascent());
+  }
+  
+  int rw1 = rw + 50 - (rw % 50);
+  mInfoSize = QSize(rw1, rh);
+}
+
+void QGoogleMap::prepareScaleBar(double scale)
+{
+  QString text0, text1, text2;
+  if (scale < 1000)
+  {
+    text0 = QString("%1").arg(scale, 0, 'f', 0);
+    text1 = text0 + " m";
+    text2 = QString("%1").arg(scale/2, 0, 'f', static_cast<int>(scale) % 2);
+  }
+  else
+  {
+    text0 = QString("%1").arg(scale/1000, 0, 'f', 0);
+    text1 = text0 + " km";
+    text2 = QString("%1").arg(scale/2000, 0, 'f', static_cast<int>(scale/1000) % 2);
+  }
+  
+  QFontMetrics fm(mOverlayFont);
+  
+  mScaleValue       = scale;
+  mScaleText0Width  = fm.width(text0);
+  mScaleText2Width  = fm.width(text2);
+  mScaleTextOffset  = fm.height() / 2 + fm.ascent();
+  mScaleText1       = QStaticText(text1);
+  mScaleText2       = QStaticText(text2);
+  mScaleText1.setTextFormat(Qt::PlainText);
+  mScaleText2.setTextFormat(Qt::PlainText);
+  mScaleText1.prepare(QTransform(), mOverlayFont);
+  mScaleText2.prepare(QTransform(), mOverlayFont);
+}
+
+void QGoogleMap::onPerfToggle()
+{
+  mPerfVisible = !mPerfVisible;
+  mPerfTimer->setInterval(mPerfVisible ? PERF_UPDATE_INTERVAL : PERF_DUMP_INTERVAL);
+  onPerfUpdate();
+  update();
+}
+
+void QGoogleMap::onPerfUpdate()
+{
+  const double now = getTimeStamp();
+  if (now - mPerfTime > EPSILON)
+    mPerf.sampleRate = (mPerf.samples - mPerfSamples) / (now - mPerfTime);
+  const double cpuTime = getCpuTime();
+  if (now - mPerfTime > EPSILON)
+    mPerf.cpuLoad = (cpuTime - mPerfCpuTime) / (now - mPerfTime) * 100;
+  mPerfSamples = mPerf.samples;
+  mPerfCpuTime = cpuTime;
+  mPerfTime    = now;
+  mWlanAddress = getWlanAddress();
+  
+  mEngine->updateStats(mPerf);
+  mPerf.received = mTelemetryReceiver->receivedCount();
+  mPerf.invalid  = mTelemetryReceiver->invalidCount();
+  
+  if (mPerfVisible)
+  {
+    preparePerfPanel();
+    update();
+  }
+  
+  if (now - mPerfDumpTime >= PERF_DUMP_INTERVAL / 1000.0 - EPSILON)
+  {
+    mPerfDumpTime = now;
+    dumpPerf();
+  }
+}
+
+void QGoogleMap::onTraceToggle()
+{
+  if (!traceEnabled())
+  {
+    mTraceTiles.clear();
+    mTraceLines.clear();
+    traceSetEnabled(true);
+    qDebug() << "Tracing started";
+    return;
+  }
+  
+  traceSetEnabled(false);
+  
+  QString fileName("%1/logs/trace-%2.json");
+  fileName = fileName.arg(mHomeDir);
+  fileName = fileName.arg(QDateTime::currentDateTime().toString("yyyy-MM-dd_hh-mm-ss"));
+  traceWrite(fileName);
+}
+
+void QGoogleMap::preparePerfPanel()
+{
+  const QStringList lines = mPerf.report().split("\n", QString::SkipEmptyParts);
+  
+  QFontMetrics fm(mOverlayFont);
+  int rw = 0;
+  
+  mPerfLines.clear();
+  for(int i = 0; i < lines.size(); ++i)
+  {
+    QStaticText line(lines[i]);
+    line.setTextFormat(Qt::PlainText);
+    line.prepare(QTransform(), mOverlayFont);
+    
+    rw = qMax(rw, fm.width(lines[i]) + 10);
+    mPerfLines.append(line);
+  }
+  mPerfSize = QSize(rw, lines.size() * (fm.height() + 1));
+}
+
+void QGoogleMap::dumpPerf()
+{
+  // Snapshot is replaced on every dump, so that monitoring reads the latest counters
+  QString text;
+  text += QString("Time       : %1\n").arg(QDateTime::currentDateTime().toString("yyyy-MM-dd hh:mm:ss"));
+  text += mPerf.report();
+  
+  QFile f(mHomeDir + "/logs/perf.txt");
+  if (f.open(QIODevice::WriteOnly | QIODevice::Truncate))
+  {
+    f.write(text.toUtf8());
+    f.close();
+  }
+}
+
+void QGoogleMap::cancelTarget(int id)
+{
+  auto iter = mTargets.find(id);
+  if (iter == mTargets.end())
+    return;
+  
+  if (isValidLocation(iter.value().latitude, iter.value().longitude))
+    removeFromIndex(mTargetIndex, iter.value().cell, id);
+  mTargets.erase(iter);
+  update();
+}
+
+void QGoogleMap::cancelAllTargets()
+{
+  mTargets.clear();
+  mTargetIndex.clear();
   update();
 }
 
-void QGoogleMap::cancelTarget()
+bool QGoogleMap::hasTarget(int id)const
 {
-  mTargetLatitude  = 0.0;
-  mTargetLongitude = 0.0;
-  mTargetAccuracy  = 0.0;
-  mTargetHistory.clear();
+  auto iter = mTargets.constFind(id);
+  return iter != mTargets.constEnd() &&
+         isValidLocation(iter.value().latitude, iter.value().longitude);
 }
 
-bool QGoogleMap::hasTarget()const
+QList<int> QGoogleMap::findTargets(double minLat, double maxLat, double minLon, double maxLon)const
 {
-  return (qAbs(mTargetLatitude)  > EPSILON || qAbs(mTargetLongitude) > EPSILON) &&
-          qAbs(mTargetLatitude)  <= 89.0 &&
-          qAbs(mTargetLongitude) <= 180.0;
+  QList<int> ids;
+  
+  const qint64 y0 = (qint64)floor(minLat / TARGET_INDEX_CELL);
+  const qint64 y1 = (qint64)floor(maxLat / TARGET_INDEX_CELL);
+  const qint64 x0 = (qint64)floor(minLon / TARGET_INDEX_CELL);
+  const qint64 x1 = (qint64)floor(maxLon / TARGET_INDEX_CELL);
+  
+  if ((y1 - y0 + 1) * (x1 - x0 + 1) > mTargetIndex.size())
+  {
+    // Area covers more cells than occupied: scanning occupied cells only
+    for(auto iter = mTargetIndex.constBegin(); iter != mTargetIndex.constEnd(); ++iter)
+    {
+      const qint32 y = (qint32)(iter.key() >> 32);
+      const qint32 x = (qint32)(iter.key() & 0xffffffff);
+      if (y >= y0 && y <= y1 && x >= x0 && x <= x1)
+        ids.append(iter.value().toList());
+    }
+  }
+  else
+  {
+    for(qint64 y = y0; y <= y1; ++y)
+      for(qint64 x = x0; x <= x1; ++x)
+      {
+        auto iter = mTargetIndex.constFind((y << 32) | (quint32)x);
+        if (iter != mTargetIndex.constEnd())
+          ids.append(iter.value().toList());
+      }
+  }
+  return ids;
 }
 
 void QGoogleMap::keyPressEvent(QKeyEvent* event)
@@ -205,6 +796,16 @@ void QGoogleMap::keyPressEvent(QKeyEvent* event)
     onZoomIn();
   else if (event->key() == Qt::Key_Minus)
     onZoomOut();
+  else if (event->key() == Qt::Key_M)
+    onMapTypeCycle();
+  else if (event->key() == Qt::Key_L)
+    onMapTypeSwap();
+  else if (event->key() == Qt::Key_O)
+    onOverlayToggle();
+  else if (event->key() == Qt::Key_P)
+    onPerfToggle();
+  else if (event->key() == Qt::Key_T)
+    onTraceToggle();
   else if (event->key() == Qt::Key_Q)
     close();
 }
@@ -219,6 +820,7 @@ void QGoogleMap::resizeEvent(QResizeEvent* event)
   mZoomOutButton -> move(width() - buttonWidth - 10, height() / 2 - padding / 2 - buttonHeight);
   mAdjustButton  -> move(width() - buttonWidth - 10, height() / 2 + padding / 2);
   mRecordButton  -> move(width() - buttonWidth - 10, height() / 2 + 3 * padding / 2 + buttonHeight);
+  scheduleRefresh();
   update();
 }
 
@@ -226,7 +828,10 @@ void QGoogleMap::mousePressEvent(QMouseEvent* event)
 {
   if (event->buttons() == Qt::LeftButton)
   {
-    mCursorPos = event->pos();
+    mCursorPos   = event->pos();
+    mMoveTime    = getTimeStamp();
+    mPanVelocity = QPointF();
+    mDragging    = true;
     event->accept();
   }
   else
@@ -235,7 +840,13 @@ void QGoogleMap::mousePressEvent(QMouseEvent* event)
 
 void QGoogleMap::mouseReleaseEvent(QMouseEvent* event)
 {
+  // Mouse stopped before release: no kinetic panning
+  if (getTimeStamp() - mMoveTime > PAN_RELEASE_TIME)
+    mPanVelocity = QPointF();
+  
   mCursorPos = QPoint();
+  mDragging  = false;
+  requestFrame();
   event->accept();
 }
 
@@ -243,20 +854,57 @@ void QGoogleMap::mouseMoveEvent(QMouseEvent* event)
 {
   if (event->buttons() == Qt::LeftButton)
   {
-    const int px = event->pos().x() - mCursorPos.x();
-    const int py = event->pos().y() - mCursorPos.y();
+    const double now = getTimeStamp();
+    const double dt  = now - mMoveTime;
+    const QPointF delta = event->pos() - mCursorPos;
+    
+    // Moves are accumulated and applied once per frame
+    mPanDelta += delta;
+    if (dt > EPSILON)
+      mPanVelocity = mPanVelocity * 0.5 + delta / dt * 0.5;
+    
     mCursorPos = event->pos();
-    onScroll(px, py);
+    mMoveTime  = now;
+    requestFrame();
     event->accept();
   }
 }
 
+void QGoogleMap::wheelEvent(QWheelEvent* event)
+{
+  // One wheel step (120) zooms by half a level
+  setZoomTarget(mZoomTarget + event->delta() / 240.0);
+  event->accept();
+}
+
+static void addTargetArrow(QPainterPath& path, double px, double py, double radius, double azimuth)
+{
+  double alpha = azimuth * M_PI / 180;
+  double sinA  = sin(alpha);
+  double cosA  = cos(alpha);
+  
+  QPointF P(px - radius * sinA * 0.22, py + radius * cosA * 0.22);
+  QPointF Q(px + radius * sinA * 0.55, py - radius * cosA * 0.55);
+  QPointF R(px + radius * cosA * 0.44 - radius * sinA * 0.55, py + radius * sinA * 0.44 + radius * cosA * 0.55);
+  QPointF S(px - radius * cosA * 0.44 - radius * sinA * 0.55, py - radius * sinA * 0.44 + radius * cosA * 0.55);
+  
+  path.moveTo(Q);
+  path.lineTo(R);
+  path.lineTo(P);
+  path.lineTo(S);
+  path.lineTo(Q);
+}
+
 void QGoogleMap::paintEvent(QPaintEvent* event)
 {
-  const double LATITUDE_COEF        = 1.0 / cos(mLatitude * M_PI / 180);
-  const double PARALLEL_DEG_LENGTH  = 40000000.0 / 360 / LATITUDE_COEF;
+  TraceScope scope("paint", "render");
+  
+  // Screen coordinates: (world - origin) * mScale, world coordinates are taken on the current tile zoom level
+  const QPointF center      = mercatorProject(mLatitude, mLongitude, mMapZoom);
+  const QPointF origin      = center - QPointF(width() / 2, height() / 2) / mScale;
+  const double  resolution  = mercatorResolution(mLatitude, mMapZoom) / mScale;  // number of meters in 1 pixel
   
-  const QFont defaultFont = this->font();
+  const double now = getTimeStamp();
   
   QPainter p;
   p.begin(this);
@@ -268,54 +916,250 @@ void QGoogleMap::paintEvent(QPaintEvent* event)
                    QPainter::NonCosmeticDefaultPen,
                    true);
   
-  // Drawing gray background
-  p.fillRect(0, 0, width(), height(), QColor(Qt::gray));
+  int tilesVisible = 0;
   
-  // Drawing map chunks
-  for(auto chunk: mMapChunks)
+  // Base layer chunks of the current zoom level, collected until the first complete frame
+  const bool startup = mPerf.startupTime < EPSILON;
+  QList<QRectF> drawnRects;
+  
+  // Collecting map chunks. Pass 0: other zoom levels of the base layer, scaled,
+  // so that there are no gray areas while the current level is loading.
+  // Pass 1: current zoom level. Pass 2: overlay (alpha-blended over the base layer).
+  QVector<MapDraw> draws;
+  double opacity = 1.0;
+  for(int pass = 0; pass < 3; ++pass)
   {
-    if (chunk.zoom != mMapZoom)
-      continue;
+    if (pass == 2)
+    {
+      if (mOverlayOpacity < EPSILON || mOverlayType == mMapType)
+        break;
+      opacity = mOverlayOpacity;
+    }
+    
+    const QString& type = (pass == 2) ? mOverlayType : mMapType;
+    for(auto iter = mMapChunks.constBegin(); iter != mMapChunks.constEnd(); ++iter)
+    {
+      const MapChunk& chunk = iter.value();
+      if (chunk.type != type || chunk.image.isNull() || (pass == 0) == (chunk.zoom == mMapZoom))
+        continue;
+      
+      const QPointF position = (mercatorProjectNear(chunk.latitude, chunk.longitude, mMapZoom, center) - origin) * mScale;
+      const double scale = mScale * pow(2.0, mMapZoom - chunk.zoom);
+      
+      if (qAbs(scale - 1.0) < EPSILON)
+      {
+        qint64 px = (qint64)round(position.x()) - chunk.image.width()  / 2;
+        qint64 py = (qint64)round(position.y()) - chunk.image.height() / 2;
+        
+        if (px > -chunk.image.width()  && px < width() &&
+            py > -chunk.image.height() && py < height())
+        {
+          MapDraw draw;
+          draw.image   = chunk.image;
+          draw.rect    = QRectF(px, py, chunk.image.width(), chunk.image.height());
+          draw.exact   = true;
+          draw.opacity = opacity;
+          draws.append(draw);
+          ++tilesVisible;
+          if (!mTraceTiles.isEmpty() && mTraceTiles.remove(iter.key()))
+            traceEvent("tile", "tile", 'e', qHash(iter.key()));
+          if (startup && pass == 1)
+            drawnRects.append(QRectF(px, py, chunk.image.width(), chunk.image.height()));
+        }
+        continue;
+      }
+      
+      const double w = chunk.image.width()  * scale;
+      const double h = chunk.image.height() * scale;
+      const QRectF rect(position.x() - w / 2, position.y() - h / 2, w, h);
+      
+      if (rect.intersects(QRectF(0, 0, width(), height())))
+      {
+        MapDraw draw;
+        draw.image   = chunk.image;
+        draw.rect    = rect;
+        draw.opacity = opacity;
+        draws.append(draw);
+        ++tilesVisible;
+        if (!mTraceTiles.isEmpty() && mTraceTiles.remove(iter.key()))
+          traceEvent("tile", "tile", 'e', qHash(iter.key()));
+        if (startup && pass == 1)
+          drawnRects.append(rect);
+      }
+    }
+  }
+  
+  // Only the final blit stays here, the map layer is composited by the thread pool
+  if (mBackbuffer.size() != size() || draws != mBackbufferDraws)
+    compositeMap(draws);
+  p.drawImage(0, 0, mBackbuffer);
+  
+  if (startup && !drawnRects.isEmpty() &&
+      CheckRectCoverage(QRectF(0, 0, width(), height()), drawnRects).isEmpty())
+  {
+    mPerf.startupTime = (getTimeStamp() - mStartTime) * 1000;
+    qDebug() << "First complete frame in" << qRound(mPerf.startupTime) << "ms," << mPerf.warmTiles << "chunks preloaded";
+  }
+  
+  // Drawing fleet targets: culled by the spatial index, clustered on low zoom levels
+  // and batched into a few paths, so that the cost doesn't grow with the fleet size
+  if (!mTargetIndex.isEmpty())
+  {
+    struct Cluster
+    {
+      double  x     = 0.0;
+      double  y     = 0.0;
+      int     count = 0;
+      int     index = 0;
+    };
+    
+    const int margin = 100;
+    double minLat, maxLat, minLon, maxLon;
+    mercatorUnproject(origin + QPointF(-margin, -margin) / mScale, mMapZoom, maxLat, minLon);
+    mercatorUnproject(origin + QPointF(width() + margin, height() + margin) / mScale, mMapZoom, minLat, maxLon);
+    
+    const QList<int> ids  = findTargets(minLat, maxLat, minLon, maxLon);
+    const bool clustering = mMapZoom < CLUSTER_ZOOM;
+    
+    // Projecting predicted positions of all candidates at once
+    QVector<int> candidates;
+    QVector<QPair<double,double> > positions;
+    candidates.reserve(ids.size());
+    positions.reserve(ids.size());
+    for(int id: ids)
+      if (id != PRIMARY_TARGET_ID)
+      {
+        candidates.append(id);
+        positions.append(predictTarget(mTargets.constFind(id).value(), now));
+      }
+    
+    QVector<QPointF> points(positions.size());
+    mercatorProjectPoints(positions.constData(), positions.size(), mMapZoom, origin, mScale, points.data());
+    
+    QPainterPath tracks, circles, markers, arrows, clusterCircles;
+    circles.setFillRule(Qt::WindingFill);
+    markers.setFillRule(Qt::WindingFill);
+    clusterCircles.setFillRule(Qt::WindingFill);
+    
+    QHash<qint64,Cluster> clusters;
+    QList<int> singles;               // Indexes of targets drawn individually
+    
+    for(int i = 0; i < candidates.size(); ++i)
+    {
+      const double px = points[i].x();
+      const double py = points[i].y();
+      
+      if (px < -margin || px >= width()  + margin ||
+          py < -margin || py >= height() + margin)
+        continue;
+      
+      if (!clustering)
+      {
+        singles.append(i);
+        continue;
+      }
+      
+      const qint32 cy = (qint32)floor(py / CLUSTER_SIZE);
+      const qint32 cx = (qint32)floor(px / CLUSTER_SIZE);
+      Cluster& cluster = clusters[((qint64)cy << 32) | (quint32)cx];
+      cluster.x += px;
+      cluster.y += py;
+      cluster.index = i;
+      ++cluster.count;
+    }
+    
+    for(auto iter = clusters.constBegin(); iter != clusters.constEnd(); ++iter)
+      if (iter.value().count == 1)
+        singles.append(iter.value().index);
+    
+    QPolygonF track;
+    for(int index: singles)
+    {
+      const MapTarget& target = mTargets.constFind(candidates[index]).value();
+      const double px = points[index].x();
+      const double py = points[index].y();
+      const double radius = target.accuracy * 10 / resolution;
+      
+      if (!clustering && !target.history.isEmpty())
+      {
+        track.resize(target.history.size());
+        mercatorProjectPoints(target.history.constData(), target.history.size(), mMapZoom, origin, mScale, track.data());
+        track.append(points[index]);
+        tracks.addPolygon(track);
+      }
+      
+      circles.addEllipse(QPointF(px, py), radius, radius);
+      markers.addEllipse(QPointF(px, py), FLEET_MARKER_RADIUS, FLEET_MARKER_RADIUS);
+      addTargetArrow(arrows, px, py, FLEET_MARKER_RADIUS, predictAzimuth(target, now));
+    }
     
-    double dx = (chunk.longitude - mLongitude);
-    double dy = (chunk.latitude  - mLatitude);
-    qint64 px = width()  / 2 + (qint64)round(dx * mDegLength) - chunk.image.width()  / 2;
-    qint64 py = height() / 2 - (qint64)round(dy * mDegLength * LATITUDE_COEF) - chunk.image.height() / 2;
+    p.setBrush(Qt::NoBrush);
+    p.setPen(QColor(0, 100, 255, 160));
+    p.drawPath(tracks);
+    p.fillPath(circles, QColor(0, 100, 255, 60));
+    p.fillPath(markers, QColor(0, 100, 255, 255));
+    p.fillPath(arrows,  QColor(255, 255, 255, 255));
     
-    if (px > -chunk.image.width()  && px < width() &&
-        py > -chunk.image.height() && py < height())
-      p.drawImage(px, py, chunk.image);
+    if (!clusters.isEmpty())
+    {
+      QList<QPair<QPointF,int> > labels;
+      for(auto iter = clusters.constBegin(); iter != clusters.constEnd(); ++iter)
+      {
+        const Cluster& cluster = iter.value();
+        if (cluster.count < 2)
+          continue;
+        const QPointF center(cluster.x / cluster.count, cluster.y / cluster.count);
+        const double radius = 12 + 4 * log10(cluster.count);
+        clusterCircles.addEllipse(center, radius, radius);
+        labels.append(qMakePair(center, cluster.count));
+      }
+      
+      p.fillPath(clusterCircles, QColor(0, 100, 255, 200));
+      p.setPen(QColor(Qt::white));
+      for(int i = 0; i < labels.size(); ++i)
+        p.drawText(QRectF(labels[i].first - QPointF(20, 10), QSizeF(40, 20)),
+                   Qt::AlignCenter, QString::number(labels[i].second));
+    }
+  }
+  
+  // Drawing the restored track until the first fix arrives
+  if (!hasTarget(PRIMARY_TARGET_ID) && mTargets.contains(PRIMARY_TARGET_ID))
+  {
+    const MapTarget& target = mTargets.constFind(PRIMARY_TARGET_ID).value();
+    if (target.history.size() > 1)
+    {
+      QPolygonF track(target.history.size());
+      mercatorProjectPoints(target.history.constData(), target.history.size(), mMapZoom, origin, mScale, track.data());
+      p.setPen(QColor(255, 100, 0, 255));
+      p.drawPolyline(track);
+    }
   }
   
   // Drawing target
-  if (hasTarget())
+  if (hasTarget(PRIMARY_TARGET_ID))
   {
+    const MapTarget& target = mTargets.constFind(PRIMARY_TARGET_ID).value();
+    const QPair<double,double> position = predictTarget(target, now);
+    const QPointF point = (mercatorProject(position.first, position.second, mMapZoom) - origin) * mScale;
+    
+    qint64 px = (qint64)round(point.x());
+    qint64 py = (qint64)round(point.y());
+    
     // Drawing track
-    if (!mTargetHistory.isEmpty())
+    if (!target.history.isEmpty())
     {
+      QPolygonF track(target.history.size());
+      mercatorProjectPoints(target.history.constData(), target.history.size(), mMapZoom, origin, mScale, track.data());
+      track.append(QPointF(px, py));
+      
       QPainterPath path;
-      for(int i = 0; i < mTargetHistory.size(); ++i)
-      {
-        double dx = mTargetHistory[i].second - mLongitude;
-        double dy = mTargetHistory[i].first  - mLatitude;
-        qint64 px = width()  / 2 + (qint64)round(dx * mDegLength);
-        qint64 py = height() / 2 - (qint64)round(dy * mDegLength * LATITUDE_COEF);
-        if (i == 0)
-          path.moveTo(px, py);
-        else
-          path.lineTo(px, py);
-      }
+      path.addPolygon(track);
       p.setPen(QColor(255, 100, 0, 255));
       p.drawPath(path);
     }
     
-    double dx = mTargetLongitude - mLongitude;
-    double dy = mTargetLatitude  - mLatitude;
-    qint64 px = width()  / 2 + (qint64)round(dx * mDegLength);
-    qint64 py = height() / 2 - (qint64)round(dy * mDegLength * LATITUDE_COEF);
-    
-    int radius  = mTargetAccuracy * 10 * mDegLength / PARALLEL_DEG_LENGTH; // External radius: navigation-determined, transparent
-    int radius1 = 25;                                                      // Internal radius: fixed, solid
+    int radius  = target.accuracy * 10 / resolution;  // External radius: navigation-determined, transparent
+    int radius1 = 25;                                   // Internal radius: fixed, solid
     
     if (px >= -100 && px < width()  + 100 &&
         py >= -100 && py < height() + 100)
@@ -332,53 +1176,21 @@ void QGoogleMap::paintEvent(QPaintEvent* event)
       //p.setBrush ( QColor(255, 0, 0, 160) );
       //p.drawEllipse(QPoint(px, py), radiusMin, radiusMin);
       
-      double alpha = mTargetAzimuth * M_PI / 180;
-      double sinA  = sin(alpha);
-      double cosA  = cos(alpha);
-      
-      //QPointF P(px, py);
-      //QPointF Q(px + radius * sinA, py - radius * cosA);
-      //QPointF R(px - radius * cosA * 0.66 - radius * sinA * 0.25, py - radius * sinA * 0.66 + radius * cosA * 0.25);
-      //QPointF S(px + radius * cosA * 0.66 - radius * sinA * 0.25, py + radius * sinA * 0.66 + radius * cosA * 0.25);
-      
-      QPointF P(px - radius1 * sinA * 0.22, py + radius1 * cosA * 0.22);
-      QPointF Q(px + radius1 * sinA * 0.55, py - radius1 * cosA * 0.55);
-      QPointF R(px + radius1 * cosA * 0.44 - radius1 * sinA * 0.55, py + radius1 * sinA * 0.44 + radius1 * cosA * 0.55);
-      QPointF S(px - radius1 * cosA * 0.44 - radius1 * sinA * 0.55, py - radius1 * sinA * 0.44 + radius1 * cosA * 0.55);
-    
       QPainterPath path;
-      path.moveTo(Q);
-      path.lineTo(R);
-      path.lineTo(P);
-      path.lineTo(S);
-      path.lineTo(Q);
+      addTargetArrow(path, px, py, radius1, predictAzimuth(target, now));
       p.fillPath(path, QBrush(QColor(255, 255, 255, 255)));
     }
   }
   
-  // Drawing info panel
-  if (!mInfoText.isEmpty())
+  // Drawing info panel (lines are prepared when the text changes)
+  if (!mInfoLines.isEmpty())
   {
-    QStringList lines = mInfoText.split("\n");
-    
-    QFont fixedFont = defaultFont;
-    fixedFont.setFamily("Courier New");
-    p.setFont(fixedFont);
-    
-    QFontMetrics fm(p.font());
-    int fh = fm.height();
-    int rh = lines.size() * (fh + 1);
-    int rw = 0;
-    
-    for(int i = 0; i < lines.size(); ++i)
-      rw = qMax(rw, fm.width(lines[i]) + 10);
-    
-    int rw1 = rw + 50 - (rw % 50);
-    p.fillRect(0, 0, rw1, rh, QColor(255, 255, 255, 128));
+    p.fillRect(0, 0, mInfoSize.width(), mInfoSize.height(), QColor(255, 255, 255, 128));
     
+    p.setFont(mOverlayFont);
     p.setPen(QColor(Qt::black));
-    for(int i = 0; i < lines.size(); ++i)
-      p.drawText(5, (i + 1) * (fh + 1), lines[i]);
+    for(int i = 0; i < mInfoLines.size(); ++i)
+      p.drawStaticText(5, mInfoLineTops[i], mInfoLines[i]);
   }
   
   // Drawing scale
@@ -386,24 +1198,14 @@ void QGoogleMap::paintEvent(QPaintEvent* event)
   {
     const int minLen  = 100;  // minimum scale length
     const int padding = 10;   // padding from the bottom-left corner of the widget
-    const double a = PARALLEL_DEG_LENGTH / mDegLength; // number of meters in 1 pixel
-    
-    QList<double> scales;
-    scales << 1e0 << 2e0 << 3e0 << 4e0 << 5e0 << 6e0 << 7e0 << 8e0 << 9e0
-           << 1e1 << 2e1 << 3e1 << 4e1 << 5e1 << 6e1 << 7e1 << 8e1 << 9e1
-           << 1e2 << 2e2 << 3e2 << 4e2 << 5e2 << 6e2 << 7e2 << 8e2 << 9e2
-           << 1e3 << 2e3 << 3e3 << 4e3 << 5e3 << 6e3 << 7e3 << 8e3 << 9e3
-           << 1e4 << 2e4 << 3e4 << 4e4 << 5e4 << 6e4 << 7e4 << 8e4 << 9e4
-           << 1e5 << 2e5 << 3e5 << 4e5 << 5e5 << 6e5 << 7e5 << 8e5 << 9e5
-           << 1e6 << 2e6 << 3e6 << 4e6 << 5e6 << 6e6 << 7e6 << 8e6 << 9e6;
-    
-    double scale = scales.last();
-    for(int i = 0; i < scales.size(); ++i)
-      if (a * minLen < scales[i])
-      {
-        scale = scales[i];
-        break;
-      }
+    const double a = resolution;  // number of meters in 1 pixel
+    
+    const double* step = std::upper_bound(SCALE_STEPS, SCALE_STEPS + SCALE_STEPS_COUNT, a * minLen);
+    const double scale = (step != SCALE_STEPS + SCALE_STEPS_COUNT) ? *step : SCALE_STEPS[SCALE_STEPS_COUNT - 1];
+    
+    // Labels depend on the scale step only
+    if (scale != mScaleValue)
+      prepareScaleBar(scale);
     
     // Calculating scale length in pixels
     int pxLen = qRound(scale / a);
@@ -414,35 +1216,122 @@ void QGoogleMap::paintEvent(QPaintEvent* event)
     p.drawLine(padding + pxLen / 2, height() - padding, padding + pxLen / 2, height() - padding - 5);
     p.drawLine(padding + pxLen, height() - padding, padding + pxLen, height() - padding - 5);
     
-    QString text0, text1, text2;
-    if (scale < 1000)
-    {
-      text0 = QString("%1").arg(scale, 0, 'f', 0);
-      text1 = text0 + " m";
-      text2 = QString("%1").arg(scale/2, 0, 'f', static_cast<int>(scale) % 2);
-    }
-    else
-    {
-      text0 = QString("%1").arg(scale/1000, 0, 'f', 0);
-      text1 = text0 + " km";
-      text2 = QString("%1").arg(scale/2000, 0, 'f', static_cast<int>(scale/1000) % 2);
-    }
-    
-    QFont font(p.font());
-    
-    QFont scaleFont = defaultFont;
-    scaleFont.setFamily("Courier New");
-    p.setFont(scaleFont);
-    
-    QFontMetrics fm(scaleFont);
+    p.setFont(mOverlayFont);
+    const int textTop = height() - padding - mScaleTextOffset;
+    p.drawStaticText(padding + pxLen - mScaleText0Width / 2, textTop, mScaleText1);
+    p.drawStaticText(padding + pxLen / 2 - mScaleText2Width / 2, textTop, mScaleText2);
+  }
+  
+  // Drawing performance panel (to the left of the buttons)
+  if (mPerfVisible && !mPerfLines.isEmpty())
+  {
+    const int left = width() - mZoomInButton->width() - 20 - mPerfSize.width();
+    const int lineHeight = mPerfSize.height() / mPerfLines.size();
+    p.fillRect(left, 0, mPerfSize.width(), mPerfSize.height(), QColor(0, 0, 0, 160));
     
-    const int textY = height() - padding - fm.height() / 2;
-    p.drawText(padding + pxLen - fm.width(text0) / 2, textY, text1);
-    p.drawText(padding + pxLen / 2 - fm.width(text2) / 2, textY, text2);
+    p.setFont(mOverlayFont);
+    p.setPen(QColor(Qt::green));
+    for(int i = 0; i < mPerfLines.size(); ++i)
+      p.drawStaticText(left + 5, i * lineHeight, mPerfLines[i]);
   }
   
   p.end();
   event->accept();
+  
+  mPerf.tilesVisible = tilesVisible;
+  mPerf.paintTime.add((getTimeStamp() - now) * 1000);
+  
+  for(int i = 0; i < mTraceLines.size(); ++i)
+    traceEvent("telemetry", "telemetry", 'e', mTraceLines[i]);
+  mTraceLines.clear();
+}
+
+// Horizontal band of the backbuffer, composited by a pool thread
+struct MapBand
+{
+  const QVector<MapDraw>*   draws         = 0;
+  uchar*                    bits          = 0;    // First line of the band in the backbuffer
+  int                       width         = 0;
+  int                       top           = 0;
+  int                       height        = 0;
+  int                       bytesPerLine  = 0;
+  QImage::Format            format        = QImage::Format_RGB32;
+};
+
+static void compositeMapBand(MapBand& band)
+{
+  TraceScope scope("band", "render");
+  
+  // Band image shares the backbuffer memory, so that every band has its own painter
+  QImage image(band.bits, band.width, band.height, band.bytesPerLine, band.format);
+  QPainter p(&image);
+  p.setRenderHints(QPainter::Antialiasing | QPainter::SmoothPixmapTransform, true);
+  p.translate(0, -band.top);
+  
+  const QRectF bandRect(0, band.top, band.width, band.height);
+  p.fillRect(bandRect, QColor(Qt::gray));
+  
+  for(int i = 0; i < band.draws->size(); ++i)
+  {
+    const MapDraw& draw = band.draws->at(i);
+    if (!draw.rect.intersects(bandRect))
+      continue;
+    
+    p.setOpacity(draw.opacity);
+    if (draw.exact)
+      p.drawImage(draw.rect.topLeft().toPoint(), draw.image);
+    else
+      p.drawImage(draw.rect, draw.image);
+  }
+}
+
+class MapBandTask: public QRunnable
+{
+  public:
+    MapBandTask(MapBand& band): mBand ( band ) { }
+    void run()
+    {
+      traceSetThreadName("composite");
+      compositeMapBand(mBand);
+    }
+  
+  private:
+    MapBand& mBand;
+};
+
+void QGoogleMap::compositeMap(const QVector<MapDraw>& draws)
+{
+  TraceScope scope("composite", "render");
+  const double start = getTimeStamp();
+  
+  mBackbufferDraws = draws;
+  if (mBackbuffer.size() != size())
+    mBackbuffer = QImage(size(), QImage::Format_RGB32);
+  if (mBackbuffer.isNull())
+    return;
+  
+  // One band per pool thread, the calling thread composites one of them too
+  const int count = qBound(1, height() / MAP_BAND_MIN_HEIGHT, mCompositePool->maxThreadCount());
+  QVector<MapBand> bands(count);
+  uchar* bits = mBackbuffer.bits();
+  for(int i = 0; i < count; ++i)
+  {
+    MapBand& band = bands[i];
+    band.draws        = &mBackbufferDraws;
+    band.width        = width();
+    band.top          = height() * i / count;
+    band.height       = height() * (i + 1) / count - band.top;
+    band.bytesPerLine = mBackbuffer.bytesPerLine();
+    band.bits         = bits + band.top * band.bytesPerLine;
+    band.format       = mBackbuffer.format();
+  }
+  for(int i = 1; i < count; ++i)
+    mCompositePool->start(new MapBandTask(bands[i]));
+  compositeMapBand(bands[0]);
+  mCompositePool->waitForDone();
+  
+  mPerf.compositeBands = count;
+  mPerf.compositeTime.add((getTimeStamp() - start) * 1000);
 }
 
 QList<QRectF> CheckRectCoverage(const QRectF& A, const QList<QRectF>& B)
@@ -505,32 +1394,55 @@ QList<QRectF> CheckRectCoverage(const QRectF& A, const QList<QRectF>& B)
 
 void QGoogleMap::refresh()
 {
-  const double LATITUDE_COEF = 1.0 / cos(mLatitude * M_PI / 180);
+  TraceScope scope("refresh", "tile");
+  
+  // Base layer is loaded with padding, alternate layer - for the visible area only
+  requestCoverage(mMapType, width() / 2, height() / 2);
+  
+  if (mOverlayType != mMapType && (mOverlayPrefetch || mOverlayOpacity > EPSILON))
+    requestCoverage(mOverlayType, 0, 0);
+  
+  if (mMapChunks.size() > MEM_CACHE_SIZE)
+    clearCache();
+  
+  // Camera follows the target on the frame timer
+  if (mAdjustButton->isChecked() && hasTarget(PRIMARY_TARGET_ID) &&
+      QDateTime::currentDateTime() > mAdjustTime)
+    requestFrame();
+}
+
+void QGoogleMap::requestCoverage(const QString& type, int paddingX, int paddingY)
+{
+  // Viewport size in pixels of the current tile zoom level
+  const int viewWidth  = (int)ceil(width()  / mScale);
+  const int viewHeight = (int)ceil(height() / mScale);
+  
+  // World coordinates of the viewport center and top-left corner
+  const QPointF center = mercatorProject(mLatitude, mLongitude, mMapZoom);
+  const QPointF origin = center - QPointF(viewWidth / 2, viewHeight / 2);
   
   // Searching for uncovered area
   QList<QRectF> rects;
   
-  int paddingX = width()  / 2;
-  int paddingY = height() / 2;
-  
   // Analysing map chunks
   for(auto chunk: mMapChunks)
   {
-    if (chunk.zoom != mMapZoom)
+    if (chunk.zoom != mMapZoom || chunk.type != type)
       continue;
     
-    // Calculating pixel coordinates of the image center
-    double dx = (chunk.longitude - mLongitude);
-    double dy = (chunk.latitude  - mLatitude);
-    qint64 px = width()  / 2 + (qint64)round(dx * mDegLength) - chunk.image.width()  / 2;
-    qint64 py = height() / 2 - (qint64)round(dy * mDegLength * LATITUDE_COEF) - chunk.image.height() / 2;
+    // Calculating pixel coordinates of the image top-left corner
+    const QPointF position = mercatorProjectNear(chunk.latitude, chunk.longitude, mMapZoom, center) - origin;
+    qint64 px = (qint64)round(position.x()) - chunk.image.width()  / 2;
+    qint64 py = (qint64)round(position.y()) - chunk.image.height() / 2;
     
-    if (px > -paddingX - chunk.image.width()  && px < width()  + paddingX &&
-        py > -paddingY - chunk.image.height() && py < height() + paddingY)
+    if (px > -paddingX - chunk.image.width()  && px < viewWidth  + paddingX &&
+        py > -paddingY - chunk.image.height() && py < viewHeight + paddingY)
       rects.append(QRectF(px, py, chunk.image.width(), chunk.image.height()));
   }
   
-  QList<QRectF> uncovered = CheckRectCoverage(QRectF(-paddingX, -paddingY, width() + 2 * paddingX, height() + 2 * paddingY), rects);
+  QList<QRectF> uncovered = CheckRectCoverage(QRectF(-paddingX, -paddingY, viewWidth + 2 * paddingX, viewHeight + 2 * paddingY), rects);
+  if (type == mMapType)
+    mPerf.tilesMissing = uncovered.size();
   
   int maxWidth  = 640;
   int maxHeight = 560;
@@ -560,53 +1472,45 @@ void QGoogleMap::refresh()
   {
     int px = uncovered[i].left();
     int py = uncovered[i].top();
-    double dx = (px - width() / 2)  / mDegLength;
-    double dy = (height() / 2 - py) / mDegLength / LATITUDE_COEF;
-    double longitude = dx + mLongitude;
-    double latitude  = dy + mLatitude;
+    double latitude, longitude;
+    mercatorUnproject(origin + QPointF(px, py), mMapZoom, latitude, longitude);
     
-    requestMap(latitude, longitude, mMapZoom);
-  }
-  
-  if (mMapChunks.size() > MEM_CACHE_SIZE)
-    clearCache();
-  
-  if (mAdjustButton->isChecked() && hasTarget())
-  {
-    QDateTime timeNow = QDateTime::currentDateTime();
-    if (timeNow > mAdjustTime)
-    {
-      mLatitude   = mTargetLatitude;
-      mLongitude  = mTargetLongitude;
-    }
+    requestMap(type, latitude, longitude, mMapZoom);
   }
 }
 
 void QGoogleMap::clearCache()
 {
-  const double LATITUDE_COEF = 1.0 / cos(mLatitude * M_PI / 180);
+  // Viewport size in pixels of the current tile zoom level
+  const int viewWidth  = (int)ceil(width()  / mScale);
+  const int viewHeight = (int)ceil(height() / mScale);
   
-  const int paddingX = width()  / 2;
-  const int paddingY = height() / 2;
+  // World coordinates of the viewport center and top-left corner
+  const QPointF center = mercatorProject(mLatitude, mLongitude, mMapZoom);
+  const QPointF origin = center - QPointF(viewWidth / 2, viewHeight / 2);
   
   // Analysing map chunks
   for(auto iter = mMapChunks.begin(); iter != mMapChunks.end(); )
   {
     const MapChunk& chunk = iter.value();
-    if (chunk.zoom != mMapZoom)
+    if (chunk.zoom != mMapZoom || (chunk.type != mMapType && chunk.type != mOverlayType))
     {
       mMapChunks.erase(iter++);
       continue;
     }
+    
+    // Alternate layer is kept for the visible area only, so that
+    // the total memory budget stays the same
+    const int paddingX = (chunk.type == mMapType) ? viewWidth  / 2 : 0;
+    const int paddingY = (chunk.type == mMapType) ? viewHeight / 2 : 0;
 
-    // Calculating pixel coordinates of the image center
-    double dx = (chunk.longitude - mLongitude);
-    double dy = (chunk.latitude  - mLatitude);
-    qint64 px = width()  / 2 + (qint64)round(dx * mDegLength) - chunk.image.width()  / 2;
-    qint64 py = height() / 2 - (qint64)round(dy * mDegLength * LATITUDE_COEF) - chunk.image.height() / 2;
+    // Calculating pixel coordinates of the image top-left corner
+    const QPointF position = mercatorProjectNear(chunk.latitude, chunk.longitude, mMapZoom, center) - origin;
+    qint64 px = (qint64)round(position.x()) - chunk.image.width()  / 2;
+    qint64 py = (qint64)round(position.y()) - chunk.image.height() / 2;
     
-    if (px <= -paddingX - chunk.image.width()  || px >= width()  + paddingX ||
-        py <= -paddingY - chunk.image.height() || py >= height() + paddingY)
+    if (px <= -paddingX - chunk.image.width()  || px >= viewWidth  + paddingX ||
+        py <= -paddingY - chunk.image.height() || py >= viewHeight + paddingY)
     {
       mMapChunks.erase(iter++);
       continue;
@@ -617,240 +1521,255 @@ void QGoogleMap::clearCache()
 
 void QGoogleMap::onZoomIn()
 {
-  if (mMapZoom < ZOOM_MAX)
-  {
-    ++mMapZoom;
-    mDegLength *= 2;
-    mZoomInButton ->setEnabled(mMapZoom < ZOOM_MAX);
-    mZoomOutButton->setEnabled(mMapZoom > ZOOM_MIN);
-  }
-  update();
+  setZoomTarget(floor(mZoomTarget + 0.5) + 1);
 }
 
 void QGoogleMap::onZoomOut()
 {
-  if (mMapZoom > ZOOM_MIN)
+  setZoomTarget(floor(mZoomTarget + 0.5) - 1);
+}
+
+void QGoogleMap::setZoomTarget(double zoom)
+{
+  mZoomTarget = qBound((double)ZOOM_MIN, zoom, (double)ZOOM_MAX);
+  mZoomInButton ->setEnabled(mZoomTarget < ZOOM_MAX);
+  mZoomOutButton->setEnabled(mZoomTarget > ZOOM_MIN);
+  requestFrame();
+}
+
+void QGoogleMap::applyZoom()
+{
+  // Tiles are loaded for the nearest integer level and scaled in between
+  const int level = qBound(ZOOM_MIN, (int)floor(mZoom + 0.5), ZOOM_MAX);
+  if (level != mMapZoom)
   {
-    --mMapZoom;
-    mDegLength /= 2;
-    mZoomInButton ->setEnabled(mMapZoom < ZOOM_MAX);
-    mZoomOutButton->setEnabled(mMapZoom > ZOOM_MIN);
+    mMapZoom = level;
+    refresh();
   }
+  mScale = pow(2.0, mZoom - mMapZoom);
+}
+
+void QGoogleMap::onMapTypeCycle()
+{
+  int index = (MAP_TYPES.indexOf(mMapType) + 1) % MAP_TYPES.size();
+  if (MAP_TYPES[index] == mOverlayType)
+    index = (index + 1) % MAP_TYPES.size();
+  mMapType = MAP_TYPES[index];
+  qDebug() << "Map type" << mMapType << ", overlay" << mOverlayType;
+  refresh();
   update();
 }
 
-void QGoogleMap::onScroll(int px, int py)
+void QGoogleMap::onMapTypeSwap()
 {
-  const double LATITUDE_COEF = 1.0 / cos(mLatitude * M_PI / 180);
-  mLatitude  += py / mDegLength / LATITUDE_COEF;
-  mLongitude -= px / mDegLength;
+  // Alternate layer is prefetched, so switching is instant
+  qSwap(mMapType, mOverlayType);
+  qDebug() << "Map type" << mMapType << ", overlay" << mOverlayType;
+  refresh();
   update();
-  
-  mAdjustTime = QDateTime::currentDateTime().addSecs(5);
 }
 
-void QGoogleMap::requestMap(double lat, double lon, int zoom)
+void QGoogleMap::onOverlayToggle()
 {
-  // Rounding latitude and longitude to 0.001
-  lat = round(lat * 1000) / 1000;
-  lon = round(lon * 1000) / 1000;
-  
-  QString hash("%1,%2,%3");
-  hash = hash.arg(zoom);
-  hash = hash.arg(lat, 0, 'f', 6);
-  hash = hash.arg(lon, 0, 'f', 6);
+  mOverlayOpacity = (mOverlayOpacity > EPSILON) ? 0.0 : 0.5;
+  refresh();
+  update();
+}
+
+void QGoogleMap::onScroll(double px, double py)
+{
+  const QPointF center = mercatorProject(mLatitude, mLongitude, mMapZoom) - QPointF(px, py) / mScale;
+  mercatorUnproject(center, mMapZoom, mLatitude, mLongitude);
+  mLatitude  = mercatorClampLatitude(mLatitude);
+  mLongitude = mercatorWrapLongitude(mLongitude);
+  scheduleRefresh();
   
-  if (mMapChunks.contains(hash))
+  // Following is resumed by the adjust timer
+  mAdjustTime = QDateTime::currentDateTime().addMSecs(ADJUST_DELAY);
+  mAdjustTimer->start();
+}
+
+void QGoogleMap::requestMap(const QString& type, double lat, double lon, int zoom)
+{
+  const QString key = TileEngine::chunkKey(type, TileEngine::chunkHash(zoom, lat, lon));
+  auto iter = mMapChunks.constFind(key);
+  if (iter != mMapChunks.constEnd())
+  {
+    // Placeholders (chunks in flight or being preloaded) are not hits
+    if (!iter.value().image.isNull())
+      ++mPerf.memoryHits;
     return;
+  }
+  
+  // Chunk span: request -> network -> decode -> cache insert -> first paint
+  TraceScope scope("requestMap", "tile");
+  traceEvent("tile", "tile", 'b', traceEnabled() ? qHash(key) : 0);
   
-  // Requesting cache storage
-  QString fileName("%1/%2-%3.png");
-  fileName = fileName.arg(mHomeDir + "/cache");
-  fileName = fileName.arg(mMapType);
-  fileName = fileName.arg(hash);
-  
-  QImage image;
-  if (image.load(fileName))
-  {
-    // Updating file timestamp
-    utime(qPrintable(fileName), 0);
-    
-    MapChunk chunk;
-    chunk.type = mMapType;
-    chunk.zoom = zoom;
-    chunk.latitude  = lat;
-    chunk.longitude = lon;
-    chunk.image = image.copy(0, 40, image.width(), image.height() - 80);
-    mMapChunks[hash] = chunk;
+  MapChunk chunk;
+  if (mEngine->requestChunk(key, chunk))
+  {
+    mMapChunks[key] = chunk;
+    if (traceEnabled())
+      mTraceTiles.insert(key);
     update();
     return;
   }
   
-  mMapChunks.insert(hash, MapChunk());
-  
-  // Requesting google api service
-  QString url("https://maps.googleapis.com/maps/api/staticmap?center=%1,%2&zoom=%3&size=640x640&maptype=%4&key=%5");
-  url = url.arg(lat, 0, 'f', 6);
-  url = url.arg(lon, 0, 'f', 6);
-  url = url.arg(zoom);
-  url = url.arg(mMapType);
-  url = url.arg(mApiKey);
+  // Placeholder until the engine reports the chunk
+  mMapChunks.insert(key, MapChunk());
+}
+
+void QGoogleMap::onChunkReady(QString key, MapChunk chunk)
+{
+  // Chunks requested by other views are taken from the shared cache when needed
+  auto iter = mMapChunks.find(key);
+  if (iter == mMapChunks.end())
+    return;
   
-  qDebug() << "Requesting " << hash << ", cached: " << mMapChunks.size();
-  QNetworkReply* reply = mNetworkManager->get(QNetworkRequest(QUrl(url)));
-  reply->setProperty("type", QString("request_map"));
-  reply->setProperty("hash", hash);
+  if (traceEnabled() && iter.value().image.isNull())
+    mTraceTiles.insert(key);
+  iter.value() = chunk;
+  scheduleRefresh();
+  update();
+}
+
+void QGoogleMap::onChunkFailed(QString key)
+{
+  auto iter = mMapChunks.find(key);
+  if (iter == mMapChunks.end() || !iter.value().image.isNull())
+    return;
   
-  QTimer* requestTimer = new QTimer(reply);
-  requestTimer->setObjectName("request_timer");
-  requestTimer->setSingleShot(true);
-  requestTimer->setInterval(5000);
-  requestTimer->start();
-  connect(requestTimer, SIGNAL(timeout()), mNetworkTimeoutSignalMapper, SLOT(map()));
-  mNetworkTimeoutSignalMapper->setMapping(requestTimer, reply);  
+  // Chunk will be requested again by the retry refresh
+  mMapChunks.erase(iter);
+  traceEvent("tile", "tile", 'e', traceEnabled() ? qHash(key) : 0);
+  QTimer::singleShot(RETRY_INTERVAL, this, SLOT(scheduleRefresh()));
 }
 
-void QGoogleMap::onRequestFinished(QNetworkReply* reply)
+void QGoogleMap::onReadLine(QString line)
 {
-  const QString url     = reply->url().toString();
-  const QString type    = reply->property("type").toString();
-  const QString hash    = reply->property("hash").toString();
-  const int errorCode   = reply->error();
-  const int statusCode  = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
-  const QByteArray data = reply->readAll();
+  TelemetrySample sample;
+  const bool valid = parseTelemetryLine(line, 0, sample);
   
-  if (errorCode == QNetworkReply::NoError)
-  {
-    if (type == "request_map")
-    {
-      QStringList values = hash.split(",");
-      const int    zoom      = values[0].toInt();
-      const double latitude  = values[1].toDouble();
-      const double longitude = values[2].toDouble();
-      
-      // Caching file
-      QString fileName("%1/%2-%3.png");
-      fileName = fileName.arg(mHomeDir + "/cache");
-      fileName = fileName.arg(mMapType);
-      fileName = fileName.arg(hash);
-      
-      QFile f(fileName);
-      if (f.open(QIODevice::WriteOnly))
-      {
-        f.write(data);
-        f.close();
-      }
-      
-      //QDir dir(mHomeDir + "/cache");
-      //QStringList fileList = dir.entryList(QStringList() << "*.png", QDir::Files, QDir::Time);
-      //while (fileList.size() > DISK_CACHE_SIZE)
-      //{
-      //  //qDebug() << "Removing" << fileList.back();
-      //  //dir.remove(fileList.back());
-      //  dir.rename(fileList.last(), fileList.last() + ".tmp");
-      //  fileList.removeLast();
-      //}
-      
-      QImage image;
-      if (image.loadFromData(data))
-      {
-        MapChunk chunk;
-        chunk.type = mMapType;
-        chunk.zoom = zoom;
-        chunk.latitude  = latitude;
-        chunk.longitude = longitude;
-        chunk.image = image.copy(0, 40, image.width(), image.height() - 80);
-        mMapChunks[hash] = chunk;
-        update();
-      }
-    }
-  }
-  else
+  const quint64 traceId = traceEnabled() ? qHash(line) : 0;
+  traceEvent("parse", "telemetry", 'n', traceId);
+  
+  if (!valid)
   {
-    qDebug() << "Request " << type << ": FAILED with error " << reply->errorString();
-    if (type == "request_map")
-      mMapChunks.remove(hash);
+    traceEvent("telemetry", "telemetry", 'e', traceId);
+    return;
   }
   
-  QTimer* timer = reply->findChild<QTimer*>("request_timer");
-  if (timer)
-    timer->stop();
+  processSamples(QVector<TelemetrySample>() << sample);
   
-  reply->deleteLater();
-}
-
-void QGoogleMap::onRequestTimeout(QObject* reply)
-{
-  dynamic_cast<QNetworkReply*>(reply)->abort();
+  // Span is closed by the next paintEvent
+  if (traceEnabled())
+  {
+    traceEvent("setTarget", "telemetry", 'n', traceId);
+    mTraceLines.append(traceId);
+  }
 }
 
-static double getTimeStamp()
+void QGoogleMap::onTelemetrySamples()
 {
-  struct timespec ts;
-  clock_gettime(CLOCK_MONOTONIC, &ts);
-  return ts.tv_sec + ts.tv_nsec * 1e-9;
+  QVector<TelemetrySample> samples;
+  samples.reserve(TELEMETRY_BATCH_SIZE);
+  
+  const int count = mTelemetryReceiver->takeSamples(samples, TELEMETRY_BATCH_SIZE);
+  if (count > 0)
+    processSamples(samples);
+  
+  // Letting the event loop breathe between large batches
+  if (count == TELEMETRY_BATCH_SIZE)
+    QTimer::singleShot(0, this, SLOT(onTelemetrySamples()));
 }
 
-void QGoogleMap::onReadLine(QString line)
+void QGoogleMap::processSamples(const QVector<TelemetrySample>& samples)
 {
+  TraceScope scope("processSamples", "telemetry");
+  
   QDateTime timeNow = QDateTime::currentDateTime();
-  QStringList parts = line.split(" ");
-  if (parts.size() == 17)
+  const double now = getTimeStamp();
+  const TelemetrySample* last = 0;
+  QByteArray logText;
+  bool changed = false;
+  
+  mPerf.samples += samples.size();
+  for(int i = 0; i < samples.size(); ++i)
   {
-    // Line format:
-    // time gx gy gz ax ay az odo_count odo_speed gps_count lat lon alt acc gprmc_count vel dir
-    double timestamp = parts[0].toDouble();
-    double latency   = getTimeStamp() - timestamp;
-    
-    double gx = parts[1].toDouble();
-    double gy = parts[2].toDouble();
-    double gz = parts[3].toDouble();
-    double ax = parts[4].toDouble();
-    double ay = parts[5].toDouble();
-    double az = parts[6].toDouble();
+    const TelemetrySample& sample = samples[i];
     
-    double odometer = parts[8].toDouble();
+    // Sample timestamps are used if they come from the same monotonic clock
+    const bool sameClock = qAbs(now - sample.timestamp) < 10.0;
+    const double time = sameClock ? sample.timestamp : now;
+    if (sameClock)
+      mPerf.latency.add((now - sample.timestamp) * 1000);
+    if (updateTarget(sample.target, sample.latitude, sample.longitude, sample.accuracy, sample.direction,
+                     sample.velocity, time))
+      changed = true;
     
-    double latitude  = parts[10].toDouble();
-    double longitude = parts[11].toDouble();
-    double altitude  = parts[12].toDouble();
-    double accuracy  = parts[13].toDouble();
-    
-    double velocity  = parts[15].toDouble();
-    double direction = parts[16].toDouble();
+    if (sample.target != PRIMARY_TARGET_ID)
+      continue;
     
-    double gps_count = parts[9].toDouble();
-    if (gps_count > EPSILON)
+    if (sample.gpsCount > EPSILON)
       mGpsTime = timeNow;
+    last = &sample;
     
-    setTarget(latitude, longitude, accuracy, direction);
+    if (mTrackRecorder && isValidLocation(sample.latitude, sample.longitude))
+    {
+      TrackRecord record;
+      record.time      = timeNow.toMSecsSinceEpoch();
+      record.latitude  = sample.latitude;
+      record.longitude = sample.longitude;
+      record.accuracy  = sample.accuracy;
+      record.azimuth   = sample.direction;
+      mTrackStore->append(record);
+    }
     
-    QMap<QString,QString> addressMap;
-    QList<QNetworkInterface> interfaces = QNetworkInterface::allInterfaces();
-    for(int i = 0; i < interfaces.size(); ++i)
+    if (!mRecordLogFile.isEmpty())
+    {
+      QString text("%1 %2 %3 %4\n");
+      text = text.arg(timeNow.toString("yyyy-MM-dd hh:mm:ss.zzz"));
+      text = text.arg(sample.latitude,  0, 'f', 6);
+      text = text.arg(sample.longitude, 0, 'f', 6);
+      text = text.arg(mGpsTime.msecsTo(timeNow) / 1000);
+      logText += text.toUtf8();
+    }
+  }
+  
+  if (!logText.isEmpty())
+  {
+    QFile f(mRecordLogFile);
+    if (f.open(QIODevice::Append))
     {
-      QList<QNetworkAddressEntry> addresses = interfaces[i].addressEntries();
-      for(int j = 0; j < addresses.size(); ++j)
-        if (addresses[j].ip().protocol() == QAbstractSocket::IPv4Protocol)
-          addressMap[interfaces[i].name()] = addresses[j].ip().toString();
+      f.write(logText);
+      f.close();
     }
+  }
+  
+  if (last)
+  {
+    // Info panel shows the latest own device sample of the batch. Values are rounded,
+    // so that the text (and the panel) doesn't change with every fix of a parked vehicle.
+    double latency = now - last->timestamp;
+    double jump    = mTargets.constFind(PRIMARY_TARGET_ID).value().error;
     
     QString text;
     
-    text += QString("IP address : %1\n").arg(addressMap.value("wlan0"));
+    text += QString("IP address : %1\n").arg(mWlanAddress);
     
-    text += QString("Latency    : %1\n").arg(latency, 0, 'f', 3);
+    text += QString("Latency    : %1 ms\n").arg(qRound(latency * 100) * 10);
+    text += QString("Fix jump   : %1 m\n").arg(jump, 0, 'f', 1);
     
     text += QString("Location   : %1, %2, %3\n")
-              .arg(latitude,  0, 'f', 6)
-              .arg(longitude, 0, 'f', 6)
-              .arg(altitude,  0, 'f', 1);
+              .arg(last->latitude,  0, 'f', 6)
+              .arg(last->longitude, 0, 'f', 6)
+              .arg(last->altitude,  0, 'f', 1);
     
-    text += QString("Direction  : %1\n").arg(direction,  0, 'f', 2);
-    text += QString("Velocity   : %1\n").arg(velocity,   0, 'f', 2);
-    text += QString("Odometer   : %1\n").arg(odometer,   0, 'f', 2);
-    text += QString("Accel      : %1, %2, %3\n").arg(ax, 0, 'f', 0).arg(ay, 0, 'f', 0).arg(az, 0, 'f', 0);
-    text += QString("Gyro       : %1, %2, %3\n").arg(gx, 0, 'f', 0).arg(gy, 0, 'f', 0).arg(gz, 0, 'f', 0);
+    text += QString("Direction  : %1\n").arg(last->direction, 0, 'f', 2);
+    text += QString("Velocity   : %1\n").arg(last->velocity,  0, 'f', 2);
+    text += QString("Odometer   : %1\n").arg(last->odoSpeed,  0, 'f', 2);
+    text += QString("Accel      : %1, %2, %3\n").arg(last->ax, 0, 'f', 0).arg(last->ay, 0, 'f', 0).arg(last->az, 0, 'f', 0);
+    text += QString("Gyro       : %1, %2, %3\n").arg(last->gx, 0, 'f', 0).arg(last->gy, 0, 'f', 0).arg(last->gz, 0, 'f', 0);
     
     qint64 gpsDelta = mGpsTime.msecsTo(timeNow);
     if (gpsDelta < 3000)
@@ -859,30 +1778,100 @@ void QGoogleMap::onReadLine(QString line)
       text += QString("GPS        : off (%1 sec)\n").arg(gpsDelta / 1000);
     
     setInfoText(text);
-    
-    if (!mRecordLogFile.isEmpty())
+  }
+  
+  // Info text changes are painted by setInfoText()
+  if (changed)
+    update();
+}
+
+void QGoogleMap::scheduleRefresh()
+{
+  // Coalescing refresh requests: at most one refresh per REFRESH_DELAY
+  if (!mRefreshTimer->isActive())
+    mRefreshTimer->start();
+}
+
+void QGoogleMap::requestFrame()
+{
+  if (!mFrameTimer->isActive())
+  {
+    mFrameTime = getTimeStamp();
+    mFrameTimer->start();
+  }
+}
+
+void QGoogleMap::onFrame()
+{
+  const double now = getTimeStamp();
+  const double dt  = qBound(0.0, now - mFrameTime, 0.1);
+  bool animating   = false;
+  mFrameTime = now;
+  
+  // Applying pan input coalesced since the last frame
+  if (!mPanDelta.isNull())
+  {
+    onScroll(mPanDelta.x(), mPanDelta.y());
+    mPanDelta  = QPointF();
+    animating  = true;
+  }
+  
+  // Kinetic panning after the mouse is released
+  if (!mDragging)
+  {
+    if (qAbs(mPanVelocity.x()) + qAbs(mPanVelocity.y()) > PAN_MIN_VELOCITY)
     {
-      QFile f(mRecordLogFile);
-      if (f.open(QIODevice::Append))
-      {
-        QString text("%1 %2 %3 %4\n");
-        text = text.arg(timeNow.toString("yyyy-MM-dd hh:mm:ss.zzz"));
-        text = text.arg(latitude,  0, 'f', 6);
-        text = text.arg(longitude, 0, 'f', 6);
-        text = text.arg(gpsDelta / 1000);
-        f.write(text.toUtf8());
-        f.close();
-      }
+      onScroll(mPanVelocity.x() * dt, mPanVelocity.y() * dt);
+      mPanVelocity *= exp(-dt / PAN_FRICTION_TIME);
+      animating = true;
+    }
+    else
+      mPanVelocity = QPointF();
+  }
+  
+  // Zoom animation
+  if (qAbs(mZoomTarget - mZoom) > ZOOM_EPSILON)
+  {
+    mZoom += (mZoomTarget - mZoom) * (1.0 - exp(-dt / ZOOM_TIME));
+    animating = true;
+  }
+  else
+    mZoom = mZoomTarget;
+  applyZoom();
+  
+  // Eased camera follow of the predicted position in adjust mode
+  if (mAdjustButton->isChecked() && hasTarget(PRIMARY_TARGET_ID) &&
+      QDateTime::currentDateTime() > mAdjustTime)
+  {
+    const QPair<double,double> position = predictTarget(mTargets.constFind(PRIMARY_TARGET_ID).value(), now);
+    const double k  = 1.0 - exp(-dt / FOLLOW_TIME);
+    const QPointF center = mercatorProject(mLatitude, mLongitude, mMapZoom);
+    const QPointF delta  = (mercatorProjectNear(position.first, position.second, mMapZoom, center) - center) * mScale;
+    mLatitude  += (position.first  - mLatitude)  * k;
+    mLongitude  = mercatorWrapLongitude(mLongitude + mercatorWrapLongitude(position.second - mLongitude) * k);
+    if (delta.manhattanLength() > 0.5)
+    {
+      scheduleRefresh();
+      animating = true;
     }
-    
-    //qDebug() << qPrintable(text) << "\n";
   }
+  
+  // Prediction doesn't change after DR_MAX_TIME since the last fix
+  if (now - mLastMoveTime < DR_MAX_TIME)
+    animating = true;
+  
+  // Idle: the timer is restarted by requestFrame()
+  if (!animating)
+    mFrameTimer->stop();
+  
+  update();
 }
 
 void QGoogleMap::onAdjustModeToggle()
 {
   mAdjustTime = QDateTime::currentDateTime();
   mAdjustButton->setIcon(mAdjustButton->isChecked() ? QIcon(":/icons/adjust_mode_on") : QIcon(":/icons/adjust_mode_off"));
+  scheduleRefresh();
 }
 
 void QGoogleMap::onRecordToggle()
@@ -935,6 +1924,7 @@ void QGoogleMap::onRecordFinished()
   mRecordProcess = 0;
 }
 
+#ifndef QGOOGLEMAP_NO_MAIN
 int main(int argc, char** argv)
 {
   QTextCodec::setCodecForLocale(QTextCodec::codecForName("UTF-8"));
@@ -955,10 +1945,30 @@ int main(int argc, char** argv)
   QString apiKey = QString(f.readAll()).trimmed();
   f.close();
   
+  // Offline cache seeding (no window): <api-key-file> --seed <options>
+  if (argc > 2 && QString(argv[2]) == "--seed")
+  {
+    QCoreApplication app(argc, argv);
+    CacheSeeder seeder(apiKey, TileEngine::defaultCacheDir());
+    if (!seeder.parseArguments(app.arguments().mid(3)) || !seeder.prepare())
+      return -1;
+    if (seeder.isDryRun())
+      return 0;
+    QTimer::singleShot(0, &seeder, SLOT(start()));
+    return app.exec();
+  }
+  
   QApplication app(argc, argv);
   
   QGoogleMap* map = new QGoogleMap(apiKey);
+  
+  // Additional telemetry sources: unix:<path> or udp:<port>
+  for(int i = 2; i < argc; ++i)
+    if (!map->addTelemetrySource(argv[i]))
+      return -1;
+  
   map->setMinimumSize(800, 480);
   map->show();
   return app.exec();
 }
+#endif
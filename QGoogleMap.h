@@ -6,13 +6,45 @@
 #include <QtNetwork/QtNetwork>
 #include <QtXml/QtXml>
 
-struct MapChunk
+#include "MercatorProjection.h"
+#include "PerfStats.h"
+#include "TelemetryReceiver.h"
+#include "TileEngine.h"
+#include "TraceRecorder.h"
+#include "TrackStore.h"
+
+struct MapTarget
 {
-  QString   type        = {};
-  int       zoom        = 0;
+  int       id          = 0;
   double    latitude    = 0.0;
   double    longitude   = 0.0;
+  double    accuracy    = 0.0;
+  double    azimuth     = 0.0;
+  qint64    cell        = 0;      // Spatial index cell (valid if location is valid)
+  double    fixTime     = 0.0;    // Monotonic time of the last fix (in seconds)
+  double    velocityN   = 0.0;    // Estimated velocity to the north (m/s)
+  double    velocityE   = 0.0;    // Estimated velocity to the east (m/s)
+  double    turnRate    = 0.0;    // Estimated heading change rate (degrees per second)
+  double    offsetN     = 0.0;    // Display offset from the last fix, decays with time (m)
+  double    offsetE     = 0.0;
+  double    offsetA     = 0.0;    // Display heading offset from the last fix, decays with time (degrees)
+  double    error       = 0.0;    // Last prediction error (m)
+  QVector<QPair<double,double> > history = {};
+};
+
+// Map layer chunk placement on the screen
+struct MapDraw
+{
   QImage    image       = {};
+  QRectF    rect        = {};     // Screen rectangle (in pixels)
+  bool      exact       = false;  // Drawn unscaled at the integer rect position
+  double    opacity     = 1.0;
+  
+  bool operator==(const MapDraw& other)const
+  {
+    return image.cacheKey() == other.image.cacheKey() && rect == other.rect &&
+           exact == other.exact && opacity == other.opacity;
+  }
 };
 
 class StdinReader: public QThread
@@ -32,31 +64,32 @@ class StdinReader: public QThread
     QTextStream mStream;
 };
 
-class CacheCleaner: public QThread
-{
-    Q_OBJECT
-  
-  public:
-    CacheCleaner(const QString& cacheDir, QObject* parent = 0);
-    
-  protected:
-    void run();
-  
-  private:
-    const QString mCacheDir;
-};
+// Returns the parts of A not covered by the rectangles B
+QList<QRectF> CheckRectCoverage(const QRectF& A, const QList<QRectF>& B);
 
 class QGoogleMap: public QWidget
 {
     Q_OBJECT
+    friend class QGoogleMapBenchmark;
   
   public:
+    // Views created with an api key share the process-wide engine (see TileEngine::instance)
     QGoogleMap(const QString& apiKey, QWidget* parent = 0);
+    QGoogleMap(TileEngine* engine, QWidget* parent = 0);
+    
+    // View with its own home directory for logs, recordings, track and saved state (e.g. in tests)
+    QGoogleMap(TileEngine* engine, const QString& homeDir, QWidget* parent = 0);
     
-    bool hasTarget()const;
+    bool hasTarget(int id = 0)const;
     void setTarget(double latitude, double longitude, double accuracy, double azimuth);
+    void setTarget(int id, double latitude, double longitude, double accuracy, double azimuth);
     void setInfoText(const QString& text);
-    void cancelTarget();
+    bool addTelemetrySource(const QString& spec);
+    void cancelTarget(int id = 0);
+    void cancelAllTargets();
+    
+    // Persistent own device track for time and area queries (shared by the views of one home directory)
+    const TrackStore* trackStore()const { return mTrackStore; }
     
   protected:
     void keyPressEvent(QKeyEvent* event);
@@ -64,47 +97,123 @@ class QGoogleMap: public QWidget
     void mousePressEvent(QMouseEvent* event);
     void mouseReleaseEvent(QMouseEvent* event);
     void mouseMoveEvent(QMouseEvent* event);
+    void wheelEvent(QWheelEvent* event);
     void paintEvent(QPaintEvent* event);
     
   private slots:
     void refresh();
+    void scheduleRefresh();
     void onZoomIn();
     void onZoomOut();
-    void onScroll(int px, int py);
-    void requestMap(double lat, double lon, int zoom);
-    void onRequestFinished(QNetworkReply* reply);
-    void onRequestTimeout(QObject* reply);
+    void onScroll(double px, double py);
+    void requestMap(const QString& type, double lat, double lon, int zoom);
+    void onChunkReady(QString key, MapChunk chunk);
+    void onChunkFailed(QString key);
     void onReadLine(QString line);
+    void onTelemetryStart();
+    void onTelemetrySamples();
+    void onFrame();
     void onAdjustModeToggle();
     void onRecordToggle();
     void onRecordFinished();
+    void onMapTypeCycle();
+    void onMapTypeSwap();
+    void onOverlayToggle();
+    void onPerfToggle();
+    void onPerfUpdate();
+    void onTraceToggle();
+    void onWarmChunk(int index);
+    void loadState();
+    void saveState();
     void clearCache();
     
   private:
-    const QString                 mApiKey;
+    void requestFrame();
+    void setZoomTarget(double zoom);
+    void applyZoom();
+    void prepareInfoPanel();
+    void prepareScaleBar(double scale);
+    void compositeMap(const QVector<MapDraw>& draws);
+    
+    // Viewport is saved per view in <home>/state-<objectName>.ini (state.ini if the name is empty),
+    // so views sharing a home directory need distinct names, set right after construction
+    QString stateFile()const;
+    void restoreTrack();
+    void preparePerfPanel();
+    void dumpPerf();
+    void requestCoverage(const QString& type, int paddingX, int paddingY);
+    bool updateTarget(int id, double latitude, double longitude, double accuracy, double azimuth,
+                      double velocity, double time);
+    void processSamples(const QVector<TelemetrySample>& samples);
+    QList<int> findTargets(double minLat, double maxLat, double minLon, double maxLon)const;
+    
+
+    TileEngine*                   mEngine;            // Shared tile loading and caching core
     const QString                 mHomeDir;
-    QNetworkAccessManager*        mNetworkManager;
-    QSignalMapper*                mNetworkTimeoutSignalMapper;
     
-    QString                       mMapType;           // Map type: roadmap, ...
+    QString                       mMapType;           // Map type: roadmap, satellite, terrain, hybrid
+    QString                       mOverlayType;       // Alternate map type (overlay / prefetch layer)
+    double                        mOverlayOpacity;    // Overlay opacity: 0 - overlay is hidden
+    bool                          mOverlayPrefetch;   // Prefetch alternate layer for the visible area
     int                           mMapZoom;           // Current zoom level
-    double                        mDegLength;         // Number of pixels in 1 degree parallel on the current zoom level
+    double                        mZoom;              // Displayed (fractional) zoom level
+    double                        mZoomTarget;        // Zoom level being animated to
+    double                        mScale;             // Display scale relative to the current tile zoom level
     double                        mLatitude;          // Center latitude
     double                        mLongitude;         // Center longitude
-    double                        mTargetLatitude;    // Target latitude
-    double                        mTargetLongitude;   // Target longitude
-    double                        mTargetAccuracy;    // Target accuracy
-    double                        mTargetAzimuth;     // Target azimuth
-    QList<QPair<double,double> >  mTargetHistory;
+    QHash<int,MapTarget>          mTargets;           // Tracked targets by id (0 - own device)
+    QHash<qint64,QSet<int> >      mTargetIndex;       // Spatial index: grid cell -> target ids
     QDateTime                     mAdjustTime;        // Adjust time
     QDateTime                     mGpsTime;
     QString                       mInfoText;
+    QString                       mWlanAddress;       // Info panel address, updated on mPerfTimer
+    QImage                        mBackbuffer;        // Map layer, composited in bands by the compositing pool
+    QThreadPool*                  mCompositePool;     // Compositing threads (not the global pool)
+    QVector<MapDraw>              mBackbufferDraws;   // Chunks in the backbuffer (the same ones are not composited again)
+    
+    QFont                         mOverlayFont;       // Info panel and scale bar font
+    QList<QStaticText>            mInfoLines;         // Info panel lines, prepared when the text changes
+    QList<int>                    mInfoLineTops;
+    QSize                         mInfoSize;          // Info panel background size
+    double                        mScaleValue;        // Scale bar step the labels are prepared for (in meters)
+    QStaticText                   mScaleText1;        // Scale bar labels
+    QStaticText                   mScaleText2;
+    int                           mScaleText0Width;
+    int                           mScaleText2Width;
+    int                           mScaleTextOffset;   // Distance from the bar to the labels top
+    
+    PerfStats                     mPerf;              // Performance counters
+    bool                          mPerfVisible;       // Performance panel is shown
+    QList<QStaticText>            mPerfLines;         // Performance panel lines, prepared on mPerfTimer
+    QSize                         mPerfSize;          // Performance panel background size
+    QTimer*                       mPerfTimer;         // Updates the panel and dumps the counters
+    double                        mPerfTime;          // Monotonic time of the last counters update
+    double                        mPerfDumpTime;      // Monotonic time of the last counters dump
+    quint64                       mPerfSamples;       // Telemetry samples counter on the last update
+    double                        mPerfCpuTime;       // Process CPU time on the last update
+    QSet<QString>                 mTraceTiles;        // Traced chunks not painted yet
+    QList<quint64>                mTraceLines;        // Traced telemetry lines not painted yet
+    double                        mStartTime;         // Monotonic start time
+    QFutureWatcher<MapChunk>*     mWarmWatcher;       // Decodes the chunks saved on exit
+    QStringList                   mWarmKeys;          // Keys of the chunks being decoded
     
     QPoint                        mCursorPos;
-    StdinReader*                  mReader;
-    CacheCleaner*                 mCacheCleaner;
+    StdinReader*                  mReader;            // Shared by all views
+    TrackStore*                   mTrackStore;        // Shared by the views of one home directory
+    bool                          mTrackRecorder;     // Own device samples are appended to the track store by this view
+    TelemetryReceiver*            mTelemetryReceiver;
+    int                           mTelemetrySources;  // Number of telemetry sources added
+    double                        mLastMoveTime;      // Monotonic time of the latest fix of a moving target
+    QTimer*                       mRefreshTimer;      // Single-shot, started by scheduleRefresh()
+    QTimer*                       mAdjustTimer;       // Single-shot, resumes adjust mode after manual scroll
+    QTimer*                       mFrameTimer;        // Frame timer, active while anything is animated
+    double                        mFrameTime;         // Monotonic time of the last frame
+    double                        mMoveTime;          // Monotonic time of the last mouse move
+    bool                          mDragging;
+    QPointF                       mPanDelta;          // Pan input accumulated since the last frame (in pixels)
+    QPointF                       mPanVelocity;       // Kinetic pan velocity (pixels per second)
     
-    QMap<QString,MapChunk>        mMapChunks;
+    QMap<QString,MapChunk>        mMapChunks;         // Working set of the view (null images are being loaded)
     
     QToolButton*                  mZoomInButton;
     QToolButton*                  mZoomOutButton;
@@ -1,6 +1,6 @@
 TARGET  = QGoogleMap.exe
-SOURCES += QGoogleMap.cpp
-HEADERS += QGoogleMap.h
+SOURCES += QGoogleMap.cpp CacheSeeder.cpp TelemetryReceiver.cpp TrackStore.cpp
+HEADERS += QGoogleMap.h CacheSeeder.h TelemetryReceiver.h TrackStore.h
 RESOURCES += QGoogleMap.qrc
 
 CONFIG += qt
@@ -9,6 +9,10 @@ Qt += gui
 QT += network
 QT += xml
 
+# Tile engine library (TileEngine.pro) is built first
+LIBS += -L$$PWD/lib -lTileEngine
+PRE_TARGETDEPS += $$PWD/lib/libTileEngine.a
+
 LIBS += -lz
 
 QMAKE_CXXFLAGS += -g -ggdb
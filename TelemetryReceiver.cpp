@@ -0,0 +1,289 @@
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "TelemetryReceiver.h"
+#include "TraceRecorder.h"
+
+const int     TELEMETRY_RCVBUF      = 4 * 1024 * 1024;  // Socket receive buffer size (in bytes)
+const int     TELEMETRY_MAX_DGRAM   = 65536;            // Maximum datagram size (in bytes)
+const int     TELEMETRY_POLL_TIME   = 100;              // Poll timeout (in milliseconds)
+
+bool parseTelemetryLine(const QString& line, int source, TelemetrySample& sample)
+{
+  QStringList parts = line.split(" ", QString::SkipEmptyParts);
+
+  // Fleet targets are prefixed with the target id, so that a socket never overwrites
+  // the own device unless asked to
+  int target = -source;
+  if (parts.size() == 18)
+  {
+    bool ok = false;
+    target = parts.takeFirst().toInt(&ok);
+    if (!ok || target < 0)
+      return false;
+  }
+
+  if (parts.size() != 17)
+    return false;
+
+  sample.target     = target;
+  sample.timestamp  = parts[0].toDouble();
+  sample.gx         = parts[1].toDouble();
+  sample.gy         = parts[2].toDouble();
+  sample.gz         = parts[3].toDouble();
+  sample.ax         = parts[4].toDouble();
+  sample.ay         = parts[5].toDouble();
+  sample.az         = parts[6].toDouble();
+  sample.odoCount   = parts[7].toDouble();
+  sample.odoSpeed   = parts[8].toDouble();
+  sample.gpsCount   = parts[9].toDouble();
+  sample.latitude   = parts[10].toDouble();
+  sample.longitude  = parts[11].toDouble();
+  sample.altitude   = parts[12].toDouble();
+  sample.accuracy   = parts[13].toDouble();
+  sample.gprmcCount = parts[14].toDouble();
+  sample.velocity   = parts[15].toDouble();
+  sample.direction  = parts[16].toDouble();
+  return true;
+}
+
+bool parseTelemetryPacket(const char* data, int size, TelemetrySample& sample)
+{
+  if (size < (int)sizeof(TelemetryPacket))
+    return false;
+
+  TelemetryPacket packet;
+  memcpy(&packet, data, sizeof(packet));
+  // Negative ids are reserved for unprefixed text lines
+  if (packet.magic != TELEMETRY_MAGIC || (qint32)packet.target < 0)
+    return false;
+
+  const double* v = packet.values;
+  sample.target     = packet.target;
+  sample.timestamp  = v[0];
+  sample.gx         = v[1];
+  sample.gy         = v[2];
+  sample.gz         = v[3];
+  sample.ax         = v[4];
+  sample.ay         = v[5];
+  sample.az         = v[6];
+  sample.odoCount   = v[7];
+  sample.odoSpeed   = v[8];
+  sample.gpsCount   = v[9];
+  sample.latitude   = v[10];
+  sample.longitude  = v[11];
+  sample.altitude   = v[12];
+  sample.accuracy   = v[13];
+  sample.gprmcCount = v[14];
+  sample.velocity   = v[15];
+  sample.direction  = v[16];
+  return true;
+}
+
+TelemetryReceiver::TelemetryReceiver(QObject* parent)
+  : QThread   ( parent )
+  , mBuffer   ( TELEMETRY_MAX_DGRAM, 0 )
+  , mPending  ( false )
+  , mStopped  ( false )
+  , mReceived ( 0 )
+  , mInvalid  ( 0 )
+{
+}
+
+TelemetryReceiver::~TelemetryReceiver()
+{
+  mStopped = true;
+  wait();
+
+  for(int i = 0; i < mSockets.size(); ++i)
+    close(mSockets[i].first);
+  for(int i = 0; i < mUnixPaths.size(); ++i)
+    unlink(qPrintable(mUnixPaths[i]));
+}
+
+bool TelemetryReceiver::addSource(const QString& spec, int source)
+{
+  if (isRunning())
+  {
+    qWarning() << "Telemetry source" << spec << "added after start";
+    return false;
+  }
+
+  int fd = -1;
+  if (spec.startsWith("unix:"))
+  {
+    const QByteArray path = spec.mid(5).toLocal8Bit();
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.isEmpty() || path.size() >= (int)sizeof(addr.sun_path))
+    {
+      qWarning() << "Invalid telemetry socket path" << spec;
+      return false;
+    }
+    strncpy(addr.sun_path, path.constData(), sizeof(addr.sun_path) - 1);
+
+    fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    unlink(path.constData());
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+      qWarning() << "Unable to bind telemetry socket" << spec << ":" << strerror(errno);
+      if (fd >= 0)
+        close(fd);
+      return false;
+    }
+    mUnixPaths.append(QString::fromLocal8Bit(path));
+  }
+  else if (spec.startsWith("udp:"))
+  {
+    bool ok = false;
+    const int port = spec.mid(4).toInt(&ok);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (!ok || port <= 0 || port > 65535)
+    {
+      qWarning() << "Invalid telemetry port" << spec;
+      return false;
+    }
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+      qWarning() << "Unable to bind telemetry socket" << spec << ":" << strerror(errno);
+      if (fd >= 0)
+        close(fd);
+      return false;
+    }
+  }
+  else
+  {
+    qWarning() << "Unknown telemetry source" << spec;
+    return false;
+  }
+
+  // Large receive buffer absorbs bursts while the queue is full
+  int bufferSize = TELEMETRY_RCVBUF;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+
+  qDebug() << "Listening telemetry" << spec << ", source" << source;
+  mSockets.append(qMakePair(fd, source));
+  return true;
+}
+
+int TelemetryReceiver::takeSamples(QVector<TelemetrySample>& samples, int maxCount)
+{
+  // Clearing the flag before draining, so that samples pushed
+  // during the drain produce another notification
+  mPending = false;
+
+  int count = 0;
+  TelemetrySample sample;
+  while (count < maxCount && mQueue.pop(sample))
+  {
+    samples.append(sample);
+    ++count;
+  }
+  return count;
+}
+
+void TelemetryReceiver::run()
+{
+  traceSetThreadName("telemetry");
+  
+  QVector<struct pollfd> fds(mSockets.size());
+  for(int i = 0; i < mSockets.size(); ++i)
+  {
+    fds[i].fd     = mSockets[i].first;
+    fds[i].events = POLLIN;
+  }
+
+  while (!mStopped)
+  {
+    if (poll(fds.data(), fds.size(), TELEMETRY_POLL_TIME) <= 0)
+      continue;
+
+    int count = 0;
+    for(int i = 0; i < fds.size(); ++i)
+      if (fds[i].revents & POLLIN)
+        count += readSocket(fds[i].fd, mSockets[i].second);
+
+    if (count > 0 && !mPending.exchange(true))
+      emit samplesReady();
+  }
+}
+
+int TelemetryReceiver::readSocket(int fd, int source)
+{
+  TraceScope scope("receive", "telemetry");
+  char* buffer = mBuffer.data();
+  int count = 0;
+
+  while (!mStopped)
+  {
+    const ssize_t size = recv(fd, buffer, mBuffer.size(), MSG_DONTWAIT);
+    if (size <= 0)
+      break;
+
+    TelemetrySample sample;
+    quint32 magic = 0;
+    if (size >= (ssize_t)sizeof(magic))
+      memcpy(&magic, buffer, sizeof(magic));
+
+    if (magic == TELEMETRY_MAGIC)
+    {
+      // Binary datagram: one or more fixed-size packets
+      for(ssize_t offset = 0; offset + (ssize_t)sizeof(TelemetryPacket) <= size; offset += sizeof(TelemetryPacket))
+      {
+        if (parseTelemetryPacket(buffer + offset, sizeof(TelemetryPacket), sample))
+        {
+          enqueue(sample);
+          ++count;
+        }
+        else
+          ++mInvalid;
+      }
+    }
+    else
+    {
+      // Text datagram: one or more lines
+      const QStringList lines = QString::fromLatin1(buffer, size).split("\n", QString::SkipEmptyParts);
+      for(int i = 0; i < lines.size(); ++i)
+      {
+        if (parseTelemetryLine(lines[i].trimmed(), source, sample))
+        {
+          enqueue(sample);
+          ++count;
+        }
+        else
+          ++mInvalid;
+      }
+    }
+  }
+  return count;
+}
+
+void TelemetryReceiver::enqueue(const TelemetrySample& sample)
+{
+  ++mReceived;
+
+  // Queue is full: waking up the consumer and waiting instead of dropping
+  while (!mQueue.push(sample))
+  {
+    if (!mPending.exchange(true))
+      emit samplesReady();
+    if (mStopped)
+      return;
+    usleep(1000);
+  }
+}
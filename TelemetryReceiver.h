@@ -0,0 +1,128 @@
+#ifndef NAVIGINE_QT_TELEMETRY_RECEIVER_H
+#define NAVIGINE_QT_TELEMETRY_RECEIVER_H
+
+#include <atomic>
+
+#include <QtCore/QtCore>
+
+// Telemetry sample (one line of the text format or one binary packet)
+struct TelemetrySample
+{
+  int       target      = 0;      // Target id: 0 - own device, negative - unprefixed lines of the socket -id
+  double    timestamp   = 0.0;    // Monotonic timestamp of the sample
+  double    gx          = 0.0;    // Gyroscope
+  double    gy          = 0.0;
+  double    gz          = 0.0;
+  double    ax          = 0.0;    // Accelerometer
+  double    ay          = 0.0;
+  double    az          = 0.0;
+  double    odoCount    = 0.0;    // Odometer
+  double    odoSpeed    = 0.0;
+  double    gpsCount    = 0.0;    // GPS
+  double    latitude    = 0.0;
+  double    longitude   = 0.0;
+  double    altitude    = 0.0;
+  double    accuracy    = 0.0;
+  double    gprmcCount  = 0.0;
+  double    velocity    = 0.0;
+  double    direction   = 0.0;
+};
+
+// Binary telemetry packet: fixed-size, host byte order (local simulators only).
+// The 17 values go in the same order as the fields of the text format.
+#pragma pack(push, 1)
+struct TelemetryPacket
+{
+  quint32   magic;
+  quint32   target;
+  double    values[17];
+};
+#pragma pack(pop)
+
+const quint32 TELEMETRY_MAGIC = 0x4d475451;   // "QTGM"
+
+// Parses text telemetry line received from the source:
+// [id] time gx gy gz ax ay az odo_count odo_speed gps_count lat lon alt acc gprmc_count vel dir
+// Source 0 is stdin, telemetry sockets are numbered from 1. Lines without the target id prefix
+// belong to the own device if read from stdin, otherwise to the target -source.
+bool parseTelemetryLine(const QString& line, int source, TelemetrySample& sample);
+
+// Parses binary telemetry packet (the target id is always given)
+bool parseTelemetryPacket(const char* data, int size, TelemetrySample& sample);
+
+// Lock-free single-producer single-consumer ring buffer
+template <typename T, int N>
+class TelemetryQueue
+{
+  public:
+    TelemetryQueue(): mHead(0), mTail(0) { }
+
+    bool push(const T& value)
+    {
+      const unsigned tail = mTail.load(std::memory_order_relaxed);
+      if (tail - mHead.load(std::memory_order_acquire) >= (unsigned)N)
+        return false;
+      mBuffer[tail % N] = value;
+      mTail.store(tail + 1, std::memory_order_release);
+      return true;
+    }
+
+    bool pop(T& value)
+    {
+      const unsigned head = mHead.load(std::memory_order_relaxed);
+      if (head == mTail.load(std::memory_order_acquire))
+        return false;
+      value = mBuffer[head % N];
+      mHead.store(head + 1, std::memory_order_release);
+      return true;
+    }
+
+  private:
+    T                     mBuffer[N];
+    std::atomic<unsigned> mHead;        // Written by consumer only
+    std::atomic<unsigned> mTail;        // Written by producer only
+};
+
+// Receives telemetry from local Unix-domain and UDP datagram sockets.
+// Samples are demultiplexed on the receiver thread and handed over to
+// the GUI thread in batches through a lock-free queue.
+class TelemetryReceiver: public QThread
+{
+    Q_OBJECT
+
+  public:
+    TelemetryReceiver(QObject* parent = 0);
+    ~TelemetryReceiver();
+
+    // Source specification: "unix:<path>" or "udp:<port>".
+    // Samples of the socket are tagged with the given source id.
+    // Sources must be added before the thread is started.
+    bool addSource(const QString& spec, int source);
+
+    // Takes up to maxCount queued samples (called from the GUI thread)
+    int takeSamples(QVector<TelemetrySample>& samples, int maxCount);
+
+    quint64 receivedCount()const { return mReceived.load(); }
+    quint64 invalidCount()const  { return mInvalid.load();  }
+
+  signals:
+    void samplesReady();
+
+  protected:
+    void run();
+
+  private:
+    int readSocket(int fd, int source);
+    void enqueue(const TelemetrySample& sample);
+
+    QList<QPair<int,int> >                  mSockets;     // Socket descriptor, default source id
+    QStringList                             mUnixPaths;   // Bound Unix socket paths (removed on exit)
+    QByteArray                              mBuffer;      // Datagram receive buffer
+    TelemetryQueue<TelemetrySample,16384>   mQueue;
+    std::atomic<bool>                       mPending;     // samplesReady() emitted, but not handled yet
+    std::atomic<bool>                       mStopped;
+    std::atomic<quint64>                    mReceived;
+    std::atomic<quint64>                    mInvalid;
+};
+
+#endif
@@ -0,0 +1,621 @@
+#include <sys/types.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include "TileEngine.h"
+#include "TilePersister.h"
+
+const char    TILE_CACHE_DIR[]      = "/var/tmp/QGoogleMap/cache";  // Cache directory of the process-wide engine
+const int     SHARED_CACHE_SIZE     = 400;    // Shared memory cache size (in chunks)
+const int     REQUEST_TIMEOUT       = 5000;   // Chunk request timeout (in milliseconds)
+const qint64  CHUNK_MAX_AGE         = 7 * 24 * 3600;  // chunk freshness lifetime if not sent by the server (in seconds)
+const int     TEMP_FILE_AGE         = 3600;   // Temporary files older than this are left by crashes (in seconds)
+
+// Cache directories of the existing engines
+static QMutex         gCacheDirsMutex;
+static QSet<QString>  gCacheDirs;
+
+static double getTimeStamp()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Chunk images are cropped by 40 pixels at the top and at the bottom
+static QImage cropChunk(const QImage& image)
+{
+  return image.copy(0, 40, image.width(), image.height() - 80);
+}
+
+// Fills the chunk type and position from its key <type>-<zoom>,<lat>,<lon>
+static bool parseChunkKey(const QString& key, MapChunk& chunk)
+{
+  const QStringList values = key.section('-', 1).split(",");
+  if (values.size() != 3)
+    return false;
+
+  chunk.type      = key.section('-', 0, 0);
+  chunk.zoom      = values[0].toInt();
+  chunk.latitude  = values[1].toDouble();
+  chunk.longitude = values[2].toDouble();
+  return true;
+}
+
+bool writeFileAtomic(const QString& fileName, const QByteArray& data)
+{
+  // Data must reach the disk before the rename does
+  return writeTempFile(fileName, data, true) && commitTempFile(fileName);
+}
+
+bool writeTempFile(const QString& fileName, const QByteArray& data, bool sync)
+{
+  const QString tempName = fileName + ".tmp";
+  QFile f(tempName);
+  if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    return false;
+
+  bool ok = f.write(data) == data.size() && f.flush();
+  if (ok && sync)
+    ok = fdatasync(f.handle()) == 0;
+  else if (ok)
+  {
+    // Writeback starts at once, so that a later sync has less to wait for (a hint only)
+    sync_file_range(f.handle(), 0, 0, SYNC_FILE_RANGE_WRITE);
+  }
+  f.close();
+  if (!ok)
+    QFile::remove(tempName);
+  return ok;
+}
+
+bool syncTempFile(const QString& fileName)
+{
+  const QString tempName = fileName + ".tmp";
+  const int fd = open(QFile::encodeName(tempName).constData(), O_RDONLY);
+  const bool ok = fd >= 0 && fdatasync(fd) == 0;
+  if (fd >= 0)
+    close(fd);
+  if (!ok)
+    QFile::remove(tempName);
+  return ok;
+}
+
+bool commitTempFile(const QString& fileName)
+{
+  // rename() replaces the existing file atomically
+  const QString tempName = fileName + ".tmp";
+  if (rename(QFile::encodeName(tempName).constData(), QFile::encodeName(fileName).constData()) != 0)
+  {
+    QFile::remove(tempName);
+    return false;
+  }
+  return true;
+}
+
+bool readChunkMeta(const QString& fileName, ChunkMeta& meta)
+{
+  QFile f(fileName);
+  if (!f.open(QIODevice::ReadOnly))
+    return false;
+
+  while (!f.atEnd())
+  {
+    const QByteArray line  = f.readLine().trimmed();
+    const QByteArray name  = line.left(line.indexOf(' '));
+    const QByteArray value = line.mid(name.size() + 1);
+    if (name == "fetched")
+      meta.fetchTime = value.toLongLong();
+    else if (name == "max_age")
+      meta.maxAge = value.toLongLong();
+    else if (name == "etag")
+      meta.etag = value;
+    else if (name == "last_modified")
+      meta.lastModified = value;
+  }
+  return meta.fetchTime > 0;
+}
+
+bool writeChunkMeta(const QString& fileName, const ChunkMeta& meta)
+{
+  return writeFileAtomic(fileName, chunkMetaText(meta));
+}
+
+QByteArray chunkMetaText(const ChunkMeta& meta)
+{
+  QByteArray text;
+  text += "fetched " + QByteArray::number(meta.fetchTime) + "\n";
+  text += "max_age " + QByteArray::number(meta.maxAge) + "\n";
+  if (!meta.etag.isEmpty())
+    text += "etag " + meta.etag + "\n";
+  if (!meta.lastModified.isEmpty())
+    text += "last_modified " + meta.lastModified + "\n";
+  return text;
+}
+
+ChunkMeta replyChunkMeta(QNetworkReply* reply)
+{
+  ChunkMeta meta;
+  meta.fetchTime    = QDateTime::currentDateTime().toTime_t();
+  meta.maxAge       = CHUNK_MAX_AGE;
+  meta.etag         = reply->rawHeader("ETag");
+  meta.lastModified = reply->rawHeader("Last-Modified");
+
+  // Cache-Control: max-age overrides the default, no-cache and no-store make the chunk stale at once
+  const QString cacheControl = QString::fromLatin1(reply->rawHeader("Cache-Control"));
+  QRegExp maxAge("max-age=(\\d+)");
+  if (maxAge.indexIn(cacheControl) >= 0)
+    meta.maxAge = maxAge.cap(1).toLongLong();
+  if (cacheControl.contains("no-cache") || cacheControl.contains("no-store"))
+    meta.maxAge = 0;
+  return meta;
+}
+
+CacheCleaner::CacheCleaner(const QString& cacheDir, QObject* parent)
+  : QThread   ( parent )
+  , mCacheDir ( cacheDir )
+{
+  setTerminationEnabled(true);
+}
+
+void CacheCleaner::run()
+{
+  bool purged = false;
+  while (true)
+  {
+    QDir dir(mCacheDir);
+    QStringList fileList = dir.entryList(QStringList() << "*.png", QDir::Files, QDir::Time);
+
+    // Chunks of an older key scheme (chunk grid or rounding) are never requested again:
+    // removing them once on startup instead of waiting for them to age out
+    if (!purged)
+    {
+      purged = true;
+      for(int i = fileList.size() - 1; i >= 0; --i)
+      {
+        const QString key = QFileInfo(fileList[i]).completeBaseName();
+        MapChunk chunk;
+        if (parseChunkKey(key, chunk) && chunk.zoom >= MERCATOR_ZOOM_MIN && chunk.zoom <= MERCATOR_ZOOM_MAX &&
+            TileEngine::chunkKey(chunk.type, TileEngine::chunkHash(chunk.zoom, chunk.latitude, chunk.longitude)) == key)
+          continue;
+
+        qDebug() << "Removing orphaned file" << fileList[i];
+        dir.remove(fileList[i]);
+        dir.remove(key + ".meta");
+        fileList.removeAt(i);
+      }
+    }
+
+    if (fileList.size() > DISK_CACHE_SIZE)
+    {
+      while (fileList.size() > DISK_CACHE_SIZE / 2)
+      {
+        qDebug() << "Removing file" << fileList.last();
+        dir.remove(fileList.last());
+        dir.remove(QFileInfo(fileList.last()).completeBaseName() + ".meta");
+        fileList.removeLast();
+      }
+    }
+
+    const QFileInfoList tempList = dir.entryInfoList(QStringList() << "*.tmp", QDir::Files);
+    for(int i = 0; i < tempList.size(); ++i)
+      if (tempList[i].lastModified().secsTo(QDateTime::currentDateTime()) > TEMP_FILE_AGE)
+        dir.remove(tempList[i].fileName());
+    usleep(60000000);
+  }
+}
+
+TileEngine::TileEngine(const QString& apiKey, const QString& cacheDir, QObject* parent)
+  : QObject   ( parent )
+  , mApiKey   ( apiKey )
+  , mCacheDir ( cacheDir )
+  , mChunks   ( SHARED_CACHE_SIZE )
+{
+  qRegisterMetaType<MapChunk>("MapChunk");
+  QDir().mkpath(mCacheDir);
+
+  // Cleaners and persisters of two engines on one directory would race
+  {
+    QMutexLocker locker(&gCacheDirsMutex);
+    const QString dir = QDir(mCacheDir).canonicalPath();
+    if (gCacheDirs.contains(dir))
+      qWarning() << "TileEngine: cache directory" << dir << "is already used by another engine";
+    gCacheDirs.insert(dir);
+  }
+
+  mNetworkManager = new QNetworkAccessManager(this);
+  connect(mNetworkManager, SIGNAL(finished(QNetworkReply*)), this, SLOT(onRequestFinished(QNetworkReply*)));
+
+  mNetworkTimeoutSignalMapper = new QSignalMapper(this);
+  connect(mNetworkTimeoutSignalMapper, SIGNAL(mapped(QObject*)),
+          this, SLOT(onRequestTimeout(QObject*)));
+
+  mCacheCleaner = new CacheCleaner(mCacheDir, this);
+  mCacheCleaner->start();
+
+  // Queued writes are flushed on exit
+  mPersister = new TilePersister(mCacheDir, this);
+  mPersister->start();
+  if (QCoreApplication::instance())
+    connect(QCoreApplication::instance(), SIGNAL(aboutToQuit()), this, SLOT(stopPersister()));
+}
+
+TileEngine::~TileEngine()
+{
+  stopPersister();
+
+  QMutexLocker locker(&gCacheDirsMutex);
+  gCacheDirs.remove(QDir(mCacheDir).canonicalPath());
+}
+
+void TileEngine::stopPersister()
+{
+  mPersister->stop();
+}
+
+TileEngine::CachedChunk::CachedChunk(const QString& key, const MapChunk& chunk, TilePersister* persister)
+  : key       ( key )
+  , chunk     ( chunk )
+  , persister ( persister )
+{
+}
+
+TileEngine::CachedChunk::~CachedChunk()
+{
+  persister->drop(key);
+}
+
+TileEngine* TileEngine::instance(const QString& apiKey)
+{
+  // Initialized once even if views are created by several threads (C++11),
+  // never deleted: the cleaner thread can't be stopped
+  static TileEngine* const engine = new TileEngine(apiKey, defaultCacheDir());
+  if (apiKey != engine->mApiKey)
+    qWarning() << "TileEngine: the shared engine is already created, api key" << apiKey << "is ignored";
+  return engine;
+}
+
+QString TileEngine::defaultCacheDir()
+{
+  return TILE_CACHE_DIR;
+}
+
+QString TileEngine::chunkKey(const QString& type, const QString& hash)
+{
+  return type + "-" + hash;
+}
+
+QString TileEngine::chunkHash(int zoom, double& lat, double& lon)
+{
+  // Snapping chunk center to the grid of the zoom level: chunks form a fixed
+  // tiling, so that any point is covered by the chunk of the nearest grid node
+  // and the disk cache can be filled in advance (see CacheSeeder)
+  QPointF point = mercatorProject(lat, lon, zoom);
+  point.setX(round(point.x() / CHUNK_GRID) * CHUNK_GRID);
+  point.setY(round(point.y() / CHUNK_GRID) * CHUNK_GRID);
+  mercatorUnproject(point, zoom, lat, lon);
+
+  // Rounding latitude and longitude to 0.000001, grid nodes beyond ±180° are the same chunks
+  lat = round(lat * 1000000) / 1000000;
+  lon = mercatorWrapLongitude(round(lon * 1000000) / 1000000);
+
+  QString hash("%1,%2,%3");
+  hash = hash.arg(zoom);
+  hash = hash.arg(lat, 0, 'f', 6);
+  hash = hash.arg(lon, 0, 'f', 6);
+  return hash;
+}
+
+QString TileEngine::chunkUrl(const QString& type, double lat, double lon, int zoom, const QString& apiKey)
+{
+  QString url("https://maps.googleapis.com/maps/api/staticmap?center=%1,%2&zoom=%3&size=640x640&maptype=%4&key=%5");
+  url = url.arg(lat, 0, 'f', 6);
+  url = url.arg(lon, 0, 'f', 6);
+  url = url.arg(zoom);
+  url = url.arg(type);
+  url = url.arg(apiKey);
+  return url;
+}
+
+MapChunk TileEngine::decodeChunk(const QString& fileName)
+{
+  MapChunk chunk;
+  QImage image;
+  if (!parseChunkKey(QFileInfo(fileName).completeBaseName(), chunk) || !image.load(fileName))
+    return MapChunk();
+
+  chunk.image = cropChunk(image);
+  return chunk;
+}
+
+QString TileEngine::chunkFile(const QString& key)const
+{
+  return QString("%1/%2.png").arg(mCacheDir).arg(key);
+}
+
+// The .meta file of a chunk is read at most once, later lookups are served from memory
+bool TileEngine::loadChunkMeta(const QString& key, ChunkMeta& meta)
+{
+  {
+    QMutexLocker locker(&mMutex);
+    auto iter = mMeta.constFind(key);
+    if (iter != mMeta.constEnd())
+    {
+      meta = iter.value();
+      return true;
+    }
+  }
+
+  if (!readChunkMeta(chunkMetaFile(key), meta))
+    return false;
+
+  QMutexLocker locker(&mMutex);
+  mMeta.insert(key, meta);
+  return true;
+}
+
+// Queues the chunk image (if any) and metadata for writing, the metadata is kept in memory
+void TileEngine::storeChunk(const QString& key, const QByteArray& data, const ChunkMeta& meta)
+{
+  {
+    QMutexLocker locker(&mMutex);
+    mMeta.insert(key, meta);
+  }
+  mPersister->enqueue(key, data, meta);
+}
+
+QString TileEngine::chunkMetaFile(const QString& key)const
+{
+  return QString("%1/%2.meta").arg(mCacheDir).arg(key);
+}
+
+bool TileEngine::requestChunk(const QString& key, MapChunk& chunk)
+{
+  const quint64 traceId = traceEnabled() ? qHash(key) : 0;
+  {
+    QMutexLocker locker(&mMutex);
+    const CachedChunk* cached = mChunks.object(key);
+    if (cached)
+    {
+      ++mStats.sharedHits;
+      chunk = cached->chunk;
+      return true;
+    }
+    if (mPending.contains(key))
+    {
+      ++mStats.collapsed;
+      traceEvent("collapsed", "tile", 'n', traceId);
+      return false;
+    }
+  }
+
+  TraceScope scope("requestChunk", "tile");
+
+  // Requesting cache storage (outside the lock, decoding is the slow part)
+  const QString fileName = chunkFile(key);
+  QImage image;
+  const double decodeStart = getTimeStamp();
+  if (parseChunkKey(key, chunk) && image.load(fileName))
+  {
+    const double decodeTime = (getTimeStamp() - decodeStart) * 1000;
+    chunk.image = cropChunk(image);
+
+    // Updating file timestamp
+    utime(qPrintable(fileName), 0);
+
+    {
+      QMutexLocker locker(&mMutex);
+      ++mStats.diskHits;
+      mStats.decodeTime.add(decodeTime);
+      mChunks.insert(key, new CachedChunk(key, chunk, mPersister));
+    }
+    traceEvent("disk hit", "tile", 'n', traceId);
+
+    // Network requests are sent from the engine thread only (queued if called from another thread)
+    QMetaObject::invokeMethod(this, "revalidateChunk", Q_ARG(QString, key));
+    return true;
+  }
+
+  {
+    // Another thread may have missed the same chunk meanwhile
+    QMutexLocker locker(&mMutex);
+    if (mPending.contains(key))
+    {
+      ++mStats.collapsed;
+      return false;
+    }
+    mPending.insert(key);
+    ++mStats.diskMisses;
+    ++mStats.tilesInFlight;
+  }
+  traceEvent("network request", "tile", 'n', traceId);
+  QMetaObject::invokeMethod(this, "startRequest", Q_ARG(QString, key));
+  return false;
+}
+
+void TileEngine::addChunk(const QString& key, const MapChunk& chunk)
+{
+  {
+    QMutexLocker locker(&mMutex);
+    mChunks.insert(key, new CachedChunk(key, chunk, mPersister));
+  }
+  QMetaObject::invokeMethod(this, "revalidateChunk", Q_ARG(QString, key));
+}
+
+void TileEngine::updateStats(PerfStats& stats)const
+{
+  QMutexLocker locker(&mMutex);
+  stats.decodeTime    = mStats.decodeTime;
+  stats.tilesInFlight = mStats.tilesInFlight;
+  stats.sharedHits    = mStats.sharedHits;
+  stats.diskHits      = mStats.diskHits;
+  stats.diskMisses    = mStats.diskMisses;
+  stats.collapsed     = mStats.collapsed;
+  stats.networkErrors = mStats.networkErrors;
+  stats.notModified   = mStats.notModified;
+  stats.replaced      = mStats.replaced;
+  locker.unlock();
+  mPersister->updateStats(stats);
+}
+
+void TileEngine::sendRequest(const QNetworkRequest& request, const QString& type, const QString& key)
+{
+  QNetworkReply* reply = mNetworkManager->get(request);
+  reply->setProperty("type", type);
+  reply->setProperty("key", key);
+
+  QTimer* requestTimer = new QTimer(reply);
+  requestTimer->setObjectName("request_timer");
+  requestTimer->setSingleShot(true);
+  requestTimer->setInterval(REQUEST_TIMEOUT);
+  requestTimer->start();
+  connect(requestTimer, SIGNAL(timeout()), mNetworkTimeoutSignalMapper, SLOT(map()));
+  mNetworkTimeoutSignalMapper->setMapping(requestTimer, reply);
+}
+
+void TileEngine::startRequest(QString key)
+{
+  MapChunk chunk;
+  parseChunkKey(key, chunk);
+
+  // Requesting google api service
+  qDebug() << "Requesting " << key;
+  sendRequest(QNetworkRequest(QUrl(chunkUrl(chunk.type, chunk.latitude, chunk.longitude, chunk.zoom, mApiKey))),
+              "request_map", key);
+}
+
+void TileEngine::revalidateChunk(QString key)
+{
+  {
+    QMutexLocker locker(&mMutex);
+    if (mRevalidating.contains(key))
+      return;
+  }
+
+  // Chunks cached before metadata was introduced are considered fetched now
+  ChunkMeta meta;
+  if (!loadChunkMeta(key, meta))
+  {
+    meta.fetchTime = QDateTime::currentDateTime().toTime_t();
+    meta.maxAge    = CHUNK_MAX_AGE;
+    storeChunk(key, QByteArray(), meta);
+    return;
+  }
+
+  if (QDateTime::currentDateTime().toTime_t() < meta.fetchTime + meta.maxAge)
+    return;
+
+  // Stale chunk is already displayed, a conditional request runs in background
+  MapChunk chunk;
+  if (!parseChunkKey(key, chunk))
+    return;
+
+  QNetworkRequest request(QUrl(chunkUrl(chunk.type, chunk.latitude, chunk.longitude, chunk.zoom, mApiKey)));
+  if (!meta.etag.isEmpty())
+    request.setRawHeader("If-None-Match", meta.etag);
+  if (!meta.lastModified.isEmpty())
+    request.setRawHeader("If-Modified-Since", meta.lastModified);
+
+  qDebug() << "Revalidating " << key;
+  {
+    QMutexLocker locker(&mMutex);
+    mRevalidating.insert(key);
+  }
+  sendRequest(request, "revalidate_map", key);
+}
+
+void TileEngine::onRequestFinished(QNetworkReply* reply)
+{
+  const QString type    = reply->property("type").toString();
+  const QString key     = reply->property("key").toString();
+  const int errorCode   = reply->error();
+  const int statusCode  = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+  const QByteArray data = reply->readAll();
+
+  TraceScope scope("onRequestFinished", "tile");
+  const quint64 traceId = traceEnabled() ? qHash(key) : 0;
+
+  {
+    QMutexLocker locker(&mMutex);
+    if (type == "request_map")
+    {
+      mPending.remove(key);
+      --mStats.tilesInFlight;
+    }
+    else
+      mRevalidating.remove(key);
+  }
+  if (type == "request_map")
+    traceEvent("network reply", "tile", 'n', traceId);
+
+  bool ok = false;
+  if (errorCode == QNetworkReply::NoError && type == "revalidate_map" && statusCode == 304)
+  {
+    // Not modified: renewing freshness, validators are kept unless new ones are sent
+    ChunkMeta meta;
+    const ChunkMeta update = replyChunkMeta(reply);
+    loadChunkMeta(key, meta);
+    meta.fetchTime = update.fetchTime;
+    meta.maxAge    = update.maxAge;
+    if (!update.etag.isEmpty())
+      meta.etag = update.etag;
+    if (!update.lastModified.isEmpty())
+      meta.lastModified = update.lastModified;
+    storeChunk(key, QByteArray(), meta);
+
+    QMutexLocker locker(&mMutex);
+    ++mStats.notModified;
+    ok = true;
+  }
+  else if (errorCode == QNetworkReply::NoError)
+  {
+    MapChunk chunk;
+    QImage image;
+    const double decodeStart = getTimeStamp();
+    if (parseChunkKey(key, chunk) && image.loadFromData(data))
+    {
+      const double decodeTime = (getTimeStamp() - decodeStart) * 1000;
+      traceEvent("decode", "tile", 'n', traceId);
+      chunk.image = cropChunk(image);
+
+      {
+        QMutexLocker locker(&mMutex);
+        mStats.decodeTime.add(decodeTime);
+        if (type == "revalidate_map")
+          ++mStats.replaced;
+        mChunks.insert(key, new CachedChunk(key, chunk, mPersister));
+      }
+
+      // Caching file on the persister thread (after the insert: replacing the entry drops the old write)
+      storeChunk(key, data, replyChunkMeta(reply));
+      traceEvent("cache insert", "tile", 'n', traceId);
+      emit chunkReady(key, chunk);
+      ok = true;
+    }
+  }
+
+  if (!ok)
+  {
+    qDebug() << "Request " << type << ": FAILED with error " << reply->errorString();
+    {
+      QMutexLocker locker(&mMutex);
+      ++mStats.networkErrors;
+    }
+    if (type == "request_map")
+      emit chunkFailed(key);
+  }
+
+  QTimer* timer = reply->findChild<QTimer*>("request_timer");
+  if (timer)
+    timer->stop();
+
+  reply->deleteLater();
+}
+
+void TileEngine::onRequestTimeout(QObject* reply)
+{
+  dynamic_cast<QNetworkReply*>(reply)->abort();
+}
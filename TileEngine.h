@@ -0,0 +1,156 @@
+#ifndef NAVIGINE_QT_TILE_ENGINE_H
+#define NAVIGINE_QT_TILE_ENGINE_H
+
+#include <QtCore/QtCore>
+#include <QtGui/QtGui>
+#include <QtNetwork/QtNetwork>
+
+#include "MercatorProjection.h"
+#include "PerfStats.h"
+#include "TraceRecorder.h"
+
+const int     DISK_CACHE_SIZE = 10000;  // Disk cache size (in chunks)
+const int     CHUNK_GRID      = 512;    // Chunk centers are snapped to this grid (in pixels)
+
+struct MapChunk
+{
+  QString   type        = {};
+  int       zoom        = 0;
+  double    latitude    = 0.0;
+  double    longitude   = 0.0;
+  QImage    image       = {};
+};
+
+Q_DECLARE_METATYPE(MapChunk)
+
+// Disk cache metadata, stored next to the chunk image as <key>.meta
+struct ChunkMeta
+{
+  qint64      fetchTime     = 0;    // Time of the last fetch or revalidation (seconds since epoch)
+  qint64      maxAge        = 0;    // Freshness lifetime (in seconds)
+  QByteArray  etag          = {};   // Validators of conditional requests
+  QByteArray  lastModified  = {};
+};
+
+// Writes the file through a temporary one renamed atomically, so that
+// a crash never leaves a truncated file
+bool writeFileAtomic(const QString& fileName, const QByteArray& data);
+
+// Same in steps, so that the writes of a batch of files overlap: writeTempFile()
+// writes <file>.tmp (synced, or queued for writeback), syncTempFile() waits
+// until it is on disk, commitTempFile() renames it over <file>
+bool writeTempFile(const QString& fileName, const QByteArray& data, bool sync);
+bool syncTempFile(const QString& fileName);
+bool commitTempFile(const QString& fileName);
+
+bool readChunkMeta(const QString& fileName, ChunkMeta& meta);
+bool writeChunkMeta(const QString& fileName, const ChunkMeta& meta);
+QByteArray chunkMetaText(const ChunkMeta& meta);
+ChunkMeta replyChunkMeta(QNetworkReply* reply);
+
+class CacheCleaner: public QThread
+{
+    Q_OBJECT
+
+  public:
+    CacheCleaner(const QString& cacheDir, QObject* parent = 0);
+
+  protected:
+    void run();
+
+  private:
+    const QString mCacheDir;
+};
+
+class TilePersister;
+
+// Tile loading and caching core, shared by any number of map views.
+// Chunks are looked up in the shared memory cache, then in the disk cache,
+// then requested from the network. Concurrent requests of the same chunk
+// are collapsed into one, every subscriber gets chunkReady() when it arrives.
+// Public methods are thread-safe, signals are emitted in the engine thread.
+class TileEngine: public QObject
+{
+    Q_OBJECT
+    friend class QGoogleMapBenchmark;
+
+  public:
+    // Every engine needs a cache directory of its own (the default one belongs to instance())
+    TileEngine(const QString& apiKey, const QString& cacheDir, QObject* parent = 0);
+    ~TileEngine();
+
+    // Process-wide engine on the default cache directory, created by the first call
+    // (thread-safe). The api key of the first call is used, later keys are ignored.
+    static TileEngine* instance(const QString& apiKey);
+
+    // Cache directory of the process-wide engine (also filled by the cache seeder)
+    static QString defaultCacheDir();
+
+    // Chunk naming, shared by the engine and the cache seeder: the disk cache
+    // file of a chunk is <cache>/<key>.png, key is <type>-<hash>
+    static QString chunkKey(const QString& type, const QString& hash);
+    static QString chunkHash(int zoom, double& lat, double& lon);
+    static QString chunkUrl(const QString& type, double lat, double lon, int zoom, const QString& apiKey);
+
+    // Loads chunk from the disk cache file <key>.png (reentrant)
+    static MapChunk decodeChunk(const QString& fileName);
+
+    QString cacheDir()const { return mCacheDir; }
+    QString chunkFile(const QString& key)const;
+
+    // Returns true and the chunk if it is in memory or on disk. Otherwise the chunk
+    // is requested (or joined to the request in progress), chunkReady() or
+    // chunkFailed() follows.
+    bool requestChunk(const QString& key, MapChunk& chunk);
+
+    // Adds a chunk decoded elsewhere (e.g. warm start) to the shared memory cache
+    void addChunk(const QString& key, const MapChunk& chunk);
+
+    // Copies the engine counters into the stats
+    void updateStats(PerfStats& stats)const;
+
+  signals:
+    void chunkReady(QString key, MapChunk chunk);
+    void chunkFailed(QString key);
+
+  private slots:
+    void startRequest(QString key);
+    void revalidateChunk(QString key);
+    void onRequestFinished(QNetworkReply* reply);
+    void onRequestTimeout(QObject* reply);
+    void stopPersister();
+
+  private:
+    // Shared cache entry: the queued write of a chunk evicted before
+    // it is flushed is dropped
+    struct CachedChunk
+    {
+      CachedChunk(const QString& key, const MapChunk& chunk, TilePersister* persister);
+      ~CachedChunk();
+
+      const QString   key;
+      const MapChunk  chunk;
+      TilePersister*  persister;
+    };
+
+    void sendRequest(const QNetworkRequest& request, const QString& type, const QString& key);
+    QString chunkMetaFile(const QString& key)const;
+    bool loadChunkMeta(const QString& key, ChunkMeta& meta);
+    void storeChunk(const QString& key, const QByteArray& data, const ChunkMeta& meta);
+
+    const QString                 mApiKey;
+    const QString                 mCacheDir;
+    QNetworkAccessManager*        mNetworkManager;
+    QSignalMapper*                mNetworkTimeoutSignalMapper;
+    CacheCleaner*                 mCacheCleaner;
+    TilePersister*                mPersister;         // Write-behind disk cache writer
+
+    mutable QMutex                mMutex;             // Guards the members below
+    QCache<QString,CachedChunk>   mChunks;            // Shared memory cache
+    QSet<QString>                 mPending;           // Keys of the chunks being downloaded
+    QSet<QString>                 mRevalidating;      // Keys of the stale chunks being revalidated
+    QHash<QString,ChunkMeta>      mMeta;              // Metadata of the chunks used since start (.meta files are read once)
+    PerfStats                     mStats;             // Tile counters of all views (view memory hits are counted by views)
+};
+
+#endif
@@ -0,0 +1,16 @@
+TEMPLATE = lib
+TARGET   = TileEngine
+CONFIG  += staticlib
+
+SOURCES += TileEngine.cpp TilePersister.cpp PerfStats.cpp TraceRecorder.cpp
+HEADERS += TileEngine.h TilePersister.h MercatorProjection.h PerfStats.h TraceRecorder.h
+
+CONFIG += qt
+QT += network
+
+QMAKE_CXXFLAGS += -g -ggdb
+QMAKE_CXXFLAGS += -std=c++11
+
+DESTDIR     = lib/
+OBJECTS_DIR = build/TileEngine/
+MOC_DIR     = build/TileEngine/
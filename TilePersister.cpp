@@ -0,0 +1,141 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "TilePersister.h"
+#include "TraceRecorder.h"
+
+const int     PERSIST_BATCH_SIZE  = 16;     // Chunks written at once without waiting
+const int     PERSIST_INTERVAL    = 250;    // Batching delay after the first queued chunk (in milliseconds)
+
+TilePersister::TilePersister(const QString& cacheDir, QObject* parent)
+  : QThread   ( parent )
+  , mCacheDir ( cacheDir )
+  , mStopping ( false )
+  , mDropped  ( 0 )
+  , mFailed   ( 0 )
+{
+}
+
+TilePersister::~TilePersister()
+{
+  stop();
+}
+
+void TilePersister::enqueue(const QString& key, const QByteArray& data, const ChunkMeta& meta)
+{
+  QMutexLocker locker(&mMutex);
+  Write& write = mQueue[key];
+  if (!data.isEmpty())
+    write.data = data;
+  write.meta = meta;
+  if (write.time <= 0.0)
+    write.time = traceTime();
+
+  if (mQueue.size() == 1 || mQueue.size() >= PERSIST_BATCH_SIZE)
+    mCondition.wakeOne();
+}
+
+void TilePersister::drop(const QString& key)
+{
+  QMutexLocker locker(&mMutex);
+  if (mQueue.remove(key) > 0)
+    ++mDropped;
+}
+
+void TilePersister::stop()
+{
+  {
+    QMutexLocker locker(&mMutex);
+    mStopping = true;
+    mCondition.wakeOne();
+  }
+  wait();
+}
+
+void TilePersister::updateStats(PerfStats& stats)const
+{
+  QMutexLocker locker(&mMutex);
+  stats.writeQueue    = mQueue.size();
+  stats.writesDropped = mDropped;
+  stats.writesFailed  = mFailed;
+  stats.writeTime     = mWriteTime;
+}
+
+void TilePersister::run()
+{
+  traceSetThreadName("persister");
+
+  QMutexLocker locker(&mMutex);
+  while (true)
+  {
+    while (mQueue.isEmpty() && !mStopping)
+      mCondition.wait(&mMutex);
+    if (mQueue.isEmpty())
+      break;
+
+    // Chunks of one refresh arrive together: waiting for the rest of the batch
+    if (!mStopping && mQueue.size() < PERSIST_BATCH_SIZE)
+      mCondition.wait(&mMutex, PERSIST_INTERVAL);
+
+    const QHash<QString,Write> batch = mQueue;
+    mQueue.clear();
+    locker.unlock();
+
+    TraceScope scope("persist", "tile");
+    QVector<double> times;
+    QStringList images;
+    QStringList metas;
+    int failed = 0;
+
+    // Temporary files of the whole batch are written first, so that their writeback overlaps
+    for(auto iter = batch.constBegin(); iter != batch.constEnd(); ++iter)
+    {
+      const QString fileName = QString("%1/%2").arg(mCacheDir).arg(iter.key());
+      const Write& write = iter.value();
+
+      // Image first: metadata without the image is never used
+      if (!write.data.isEmpty())
+      {
+        if (!writeTempFile(fileName + ".png", write.data, false))
+        {
+          qWarning() << "Unable to write" << fileName + ".png";
+          ++failed;
+          continue;
+        }
+        images.append(fileName + ".png");
+      }
+      if (writeTempFile(fileName + ".meta", chunkMetaText(write.meta), false))
+        metas.append(fileName + ".meta");
+      times.append(write.time);
+    }
+
+    // Images reach the disk before they replace the cached ones. Metadata is not synced:
+    // a lost .meta only makes the chunk count as fetched at the next start.
+    for(int i = 0; i < images.size(); ++i)
+    {
+      if (!syncTempFile(images[i]) || !commitTempFile(images[i]))
+      {
+        qWarning() << "Unable to write" << images[i];
+        ++failed;
+      }
+    }
+    for(int i = 0; i < metas.size(); ++i)
+      if (!commitTempFile(metas[i]))
+        qWarning() << "Unable to write" << metas[i];
+
+    // Renames of the batch are made durable at once
+    const int dir = open(QFile::encodeName(mCacheDir).constData(), O_RDONLY | O_DIRECTORY);
+    if (dir < 0 || fsync(dir) != 0)
+      qWarning() << "Unable to sync" << mCacheDir;
+    if (dir >= 0)
+      close(dir);
+
+    for(int i = 0; i < times.size(); ++i)
+      times[i] = (traceTime() - times[i]) / 1000;
+
+    locker.relock();
+    mFailed += failed;
+    for(int i = 0; i < times.size(); ++i)
+      mWriteTime.add(times[i]);
+  }
+}
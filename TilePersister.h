@@ -0,0 +1,56 @@
+#ifndef NAVIGINE_QT_TILE_PERSISTER_H
+#define NAVIGINE_QT_TILE_PERSISTER_H
+
+#include <QtCore/QtCore>
+
+#include "PerfStats.h"
+#include "TileEngine.h"
+
+// Write-behind disk cache writer. Downloaded chunks are queued by the engine
+// and written in batches on this thread, so that a slow disk never stalls the
+// GUI. Every file is written through a temporary one and renamed atomically,
+// the cache directory is synced once per batch.
+class TilePersister: public QThread
+{
+    Q_OBJECT
+
+  public:
+    TilePersister(const QString& cacheDir, QObject* parent = 0);
+    ~TilePersister();
+
+    // Queues the chunk image and metadata, empty data updates the metadata only.
+    // A queued write of the same chunk is replaced.
+    void enqueue(const QString& key, const QByteArray& data, const ChunkMeta& meta);
+
+    // Cancels the queued write of the chunk (e.g. evicted before it is flushed)
+    void drop(const QString& key);
+
+    // Writes the queued chunks and stops the thread
+    void stop();
+
+    // Copies the write counters into the stats
+    void updateStats(PerfStats& stats)const;
+
+  protected:
+    void run();
+
+  private:
+    struct Write
+    {
+      QByteArray  data    = {};
+      ChunkMeta   meta    = {};
+      double      time    = 0.0;  // Monotonic time of the first enqueue (in microseconds)
+    };
+
+    const QString           mCacheDir;
+
+    mutable QMutex          mMutex;       // Guards the members below
+    QWaitCondition          mCondition;   // Signalled on the first queued write, full batch and stop
+    QHash<QString,Write>    mQueue;       // Writes to be flushed by key
+    bool                    mStopping;
+    quint64                 mDropped;     // Writes cancelled before flushing
+    quint64                 mFailed;
+    PerfSeries              mWriteTime;   // Enqueue to rename latency
+};
+
+#endif
@@ -0,0 +1,164 @@
+#include <time.h>
+#include <unistd.h>
+
+#include "TraceRecorder.h"
+
+const int     TRACE_BUFFER_SIZE = 65536;  // Events per thread (the oldest events are overwritten)
+
+// Ring buffer of one thread. The mutex is taken by the owning thread on
+// every event and by traceWrite(), so it is uncontended while recording.
+struct TraceBuffer
+{
+  QMutex              mutex;
+  QVector<TraceEvent> events;
+  int                 next    = 0;      // Next position to be written
+  bool                wrapped = false;  // Buffer is full, the oldest event is at 'next'
+  int                 tid     = 0;
+  QByteArray          name;
+};
+
+std::atomic<bool> gTraceEnabled(false);
+
+static QMutex               gTraceBuffersMutex;
+static QList<TraceBuffer*>  gTraceBuffers;      // Never freed: threads live until exit
+static thread_local TraceBuffer* gThreadBuffer = 0;
+static thread_local const char*  gThreadName   = 0;   // Set before the buffer is allocated
+
+// Buffers are allocated on the first recorded event, so that threads
+// cost nothing while tracing is disabled
+static TraceBuffer* threadBuffer()
+{
+  if (!gThreadBuffer)
+  {
+    TraceBuffer* buffer = new TraceBuffer;
+    buffer->events.resize(TRACE_BUFFER_SIZE);
+    buffer->name = gThreadName;
+
+    QMutexLocker locker(&gTraceBuffersMutex);
+    buffer->tid = gTraceBuffers.size() + 1;
+    gTraceBuffers.append(buffer);
+    gThreadBuffer = buffer;
+  }
+  return gThreadBuffer;
+}
+
+void traceSetEnabled(bool enabled)
+{
+  if (enabled)
+  {
+    QMutexLocker locker(&gTraceBuffersMutex);
+    for(int i = 0; i < gTraceBuffers.size(); ++i)
+    {
+      QMutexLocker bufferLocker(&gTraceBuffers[i]->mutex);
+      gTraceBuffers[i]->next    = 0;
+      gTraceBuffers[i]->wrapped = false;
+    }
+  }
+  gTraceEnabled = enabled;
+}
+
+void traceSetThreadName(const char* name)
+{
+  // Pool threads name themselves on every task
+  if (gThreadName == name)
+    return;
+
+  gThreadName = name;
+  if (gThreadBuffer)
+  {
+    QMutexLocker locker(&gThreadBuffer->mutex);
+    gThreadBuffer->name = name;
+  }
+}
+
+double traceTime()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec * 1e-3;
+}
+
+void traceEvent(const char* name, const char* category, char phase, quint64 id,
+                double time, double duration)
+{
+  if (!traceEnabled())
+    return;
+
+  TraceBuffer* buffer = threadBuffer();
+  QMutexLocker locker(&buffer->mutex);
+
+  TraceEvent& event = buffer->events[buffer->next];
+  event.name      = name;
+  event.category  = category;
+  event.phase     = phase;
+  event.time      = (time > 0.0) ? time : traceTime();
+  event.duration  = duration;
+  event.id        = id;
+
+  if (++buffer->next == TRACE_BUFFER_SIZE)
+  {
+    buffer->next    = 0;
+    buffer->wrapped = true;
+  }
+}
+
+bool traceWrite(const QString& fileName)
+{
+  QFile f(fileName);
+  if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate))
+  {
+    qWarning() << "Unable to write trace" << fileName;
+    return false;
+  }
+
+  const qint64 pid = getpid();
+  QByteArray text = "{\"traceEvents\":[\n";
+  bool first = true;
+
+  QMutexLocker locker(&gTraceBuffersMutex);
+  for(int i = 0; i < gTraceBuffers.size(); ++i)
+  {
+    TraceBuffer* buffer = gTraceBuffers[i];
+    QMutexLocker bufferLocker(&buffer->mutex);
+
+    if (!buffer->name.isEmpty())
+    {
+      text += QString("%1{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%2,\"tid\":%3,\"args\":{\"name\":\"%4\"}}")
+                .arg(first ? "" : ",\n").arg(pid).arg(buffer->tid).arg(QString(buffer->name)).toUtf8();
+      first = false;
+    }
+
+    const int count = buffer->wrapped ? TRACE_BUFFER_SIZE : buffer->next;
+    const int start = buffer->wrapped ? buffer->next : 0;
+    for(int j = 0; j < count; ++j)
+    {
+      const TraceEvent& event = buffer->events[(start + j) % TRACE_BUFFER_SIZE];
+
+      QString line("%1{\"name\":\"%2\",\"cat\":\"%3\",\"ph\":\"%4\",\"ts\":%5,\"pid\":%6,\"tid\":%7");
+      line = line.arg(first ? "" : ",\n");
+      line = line.arg(event.name);
+      line = line.arg(event.category);
+      line = line.arg(QChar(event.phase));
+      line = line.arg(event.time, 0, 'f', 3);
+      line = line.arg(pid);
+      line = line.arg(buffer->tid);
+
+      if (event.phase == 'X')
+        line += QString(",\"dur\":%1").arg(event.duration, 0, 'f', 3);
+      else if (event.phase == 'i')
+        line += ",\"s\":\"t\"";
+      else
+        line += QString(",\"id\":\"0x%1\"").arg(event.id, 0, 16);
+      line += "}";
+
+      text += line.toUtf8();
+      first = false;
+    }
+  }
+  text += "\n]}\n";
+
+  f.write(text);
+  f.close();
+  qDebug() << "Trace written to" << fileName;
+  return true;
+}
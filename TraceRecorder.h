@@ -0,0 +1,71 @@
+#ifndef NAVIGINE_QT_TRACE_RECORDER_H
+#define NAVIGINE_QT_TRACE_RECORDER_H
+
+#include <atomic>
+
+#include <QtCore/QtCore>
+
+// Lightweight event tracing in the Chrome trace format (chrome://tracing, ui.perfetto.dev).
+// Events are recorded into per-thread ring buffers, so recording threads never
+// contend with each other. Names and categories must be string literals:
+// only the pointers are stored.
+
+struct TraceEvent
+{
+  const char* name      = 0;
+  const char* category  = 0;
+  char        phase     = 0;      // 'X' - complete, 'b'/'n'/'e' - async begin/instant/end, 'i' - instant
+  double      time      = 0.0;    // Monotonic time (in microseconds)
+  double      duration  = 0.0;    // Duration of complete events (in microseconds)
+  quint64     id        = 0;      // Async event id
+};
+
+extern std::atomic<bool> gTraceEnabled;
+
+inline bool traceEnabled()
+{
+  return gTraceEnabled.load(std::memory_order_relaxed);
+}
+
+// Enables or disables recording. Enabling clears the buffers.
+void traceSetEnabled(bool enabled);
+
+// Names the calling thread in the trace (string literal, cheap if the name is unchanged)
+void traceSetThreadName(const char* name);
+
+// Monotonic time (in microseconds)
+double traceTime();
+
+// Records an event on the calling thread (no-op while tracing is disabled)
+void traceEvent(const char* name, const char* category, char phase, quint64 id = 0,
+                double time = 0.0, double duration = 0.0);
+
+// Writes recorded events of all threads as Chrome trace JSON
+bool traceWrite(const QString& fileName);
+
+// Records a complete event for the enclosing scope
+class TraceScope
+{
+  public:
+    TraceScope(const char* name, const char* category)
+      : mName     ( name )
+      , mCategory ( category )
+      , mStart    ( traceEnabled() ? traceTime() : 0.0 )
+    { }
+
+    ~TraceScope()
+    {
+      if (mStart > 0.0 && traceEnabled())
+      {
+        const double now = traceTime();
+        traceEvent(mName, mCategory, 'X', 0, mStart, now - mStart);
+      }
+    }
+
+  private:
+    const char*   mName;
+    const char*   mCategory;
+    const double  mStart;
+};
+
+#endif
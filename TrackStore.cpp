@@ -0,0 +1,432 @@
+#include <math.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "TrackStore.h"
+
+const quint32 TRACK_MAGIC           = 0x4b525451;   // "QTRK"
+const quint32 TRACK_VERSION         = 1;
+const int     TRACK_BLOCK_SIZE      = 1024;         // Records per index block
+const qint64  TRACK_GROW_SIZE       = 65536;        // Data file growth step (in records)
+const double  TRACK_GRID_CELL       = 0.01;         // Grid index cell size (in degrees)
+const qint64  TRACK_MAX_BLOCK_CELLS = 64;           // Blocks spanning more cells are not put into the grid
+const int     TRACK_SYNC_INTERVAL   = 5000;         // Appended records are synced to disk this often (in milliseconds)
+
+// Data file header, followed by the records
+struct TrackHeader
+{
+  quint32   magic       = TRACK_MAGIC;
+  quint32   version     = TRACK_VERSION;
+  qint64    count       = 0;      // Number of complete records
+  char      reserved[48] = {};
+};
+
+static_assert(sizeof(TrackHeader) == 64, "Track header layout");
+static_assert(sizeof(TrackRecord) == 32, "Track record layout");
+static_assert(sizeof(TrackBlock)  == 48, "Track block layout");
+
+static qint64 trackCell(qint32 y, qint32 x)
+{
+  return ((qint64)y << 32) | (quint32)x;
+}
+
+static void extendBlock(TrackBlock& summary, const TrackRecord& record)
+{
+  summary.minTime = qMin(summary.minTime, record.time);
+  summary.maxTime = qMax(summary.maxTime, record.time);
+  summary.minLat  = qMin(summary.minLat,  record.latitude);
+  summary.maxLat  = qMax(summary.maxLat,  record.latitude);
+  summary.minLon  = qMin(summary.minLon,  record.longitude);
+  summary.maxLon  = qMax(summary.maxLon,  record.longitude);
+}
+
+// Background thread of an open store
+class TrackSyncer: public QThread
+{
+  public:
+    TrackSyncer(TrackStore* store): mStore ( store ) { }
+
+  protected:
+    void run() { mStore->syncLoop(); }
+
+  private:
+    TrackStore* mStore;
+};
+
+TrackStore::TrackStore()
+  : mMap          ( 0 )
+  , mRecords      ( 0 )
+  , mCapacity     ( 0 )
+  , mCount        ( 0 )
+  , mSyncer       ( 0 )
+  , mSyncStopping ( false )
+  , mAppended     ( 0 )
+  , mSynced       ( 0 )
+{
+}
+
+TrackStore::~TrackStore()
+{
+  close();
+}
+
+bool TrackStore::open(const QString& dirName)
+{
+  close();
+  QDir().mkpath(dirName);
+
+  mDataFile.setFileName(dirName + "/track.dat");
+  mIndexFile.setFileName(dirName + "/track.idx");
+  if (!mDataFile.open(QIODevice::ReadWrite) || !mIndexFile.open(QIODevice::ReadWrite))
+  {
+    qWarning() << "Unable to open track store" << dirName;
+    close();
+    return false;
+  }
+
+  // Lock is released when the file is closed
+  if (flock(mDataFile.handle(), LOCK_EX | LOCK_NB) != 0)
+  {
+    qWarning() << "Track store" << dirName << "is used by another process";
+    close();
+    return false;
+  }
+
+  TrackHeader header;
+  if (mDataFile.size() < (qint64)sizeof(TrackHeader))
+    mDataFile.write((const char*)&header, sizeof(header));
+  else if (mDataFile.read((char*)&header, sizeof(header)) != sizeof(header) ||
+           header.magic != TRACK_MAGIC || header.version != TRACK_VERSION)
+  {
+    qWarning() << "Track store" << dirName << "has unsupported format";
+    close();
+    return false;
+  }
+
+  const qint64 capacity = (mDataFile.size() - sizeof(TrackHeader)) / sizeof(TrackRecord);
+  if (!reserve(qMax(capacity, TRACK_GROW_SIZE)))
+  {
+    close();
+    return false;
+  }
+  int count = (int)qBound<qint64>(0, header.count, mCapacity);
+
+  // Stores written before the count covered synced records only may count records
+  // that were lost by a power loss, they read back as zeros
+  while (count > 0 && mRecords[count - 1].time <= 0)
+    --count;
+  if (count != header.count)
+  {
+    qWarning() << "Track store" << dirName << ": dropped" << header.count - count << "incomplete records";
+    ((TrackHeader*)mMap)->count = count;
+    syncRange(0, sizeof(TrackHeader));
+  }
+
+  // Summaries lost by a crash and the open block are computed from the records
+  const int stored = (int)qMin<qint64>(mIndexFile.size() / sizeof(TrackBlock), count / TRACK_BLOCK_SIZE);
+  mBlocks.resize(stored);
+  mIndexFile.read((char*)mBlocks.data(), stored * sizeof(TrackBlock));
+  mIndexFile.resize(stored * sizeof(TrackBlock));
+
+  // Summaries zeroed or torn by a power loss are computed again, otherwise queries would skip their records
+  int repaired = 0;
+  for(int i = 0; i < stored; ++i)
+  {
+    if (!isValidBlock(i))
+    {
+      mBlocks[i] = summarizeBlock(i);
+      mIndexFile.seek(i * sizeof(TrackBlock));
+      mIndexFile.write((const char*)&mBlocks[i], sizeof(TrackBlock));
+      ++repaired;
+    }
+    addToGrid(i);
+  }
+  if (repaired > 0)
+  {
+    qWarning() << "Track store" << dirName << ": repaired" << repaired << "block summaries";
+    mIndexFile.flush();
+  }
+  mIndexFile.seek(stored * sizeof(TrackBlock));
+
+  for(mCount = stored * TRACK_BLOCK_SIZE; mCount < count; )
+    indexRecord(mCount++);
+
+  mAppended     = mCount;
+  mSynced       = mCount;
+  mSyncStopping = false;
+  mSyncer = new TrackSyncer(this);
+  mSyncer->start();
+
+  qDebug() << "Track store" << dirName << ":" << mCount << "records," << mBlocks.size() << "blocks";
+  return true;
+}
+
+void TrackStore::close()
+{
+  // Records appended since the last sync are synced now
+  stopSyncer();
+  if (mMap)
+  {
+    syncRecords();
+    mDataFile.unmap(mMap);
+  }
+  mDataFile.close();
+  mIndexFile.close();
+
+  mMap      = 0;
+  mRecords  = 0;
+  mCapacity = 0;
+  mCount    = 0;
+  mAppended = 0;
+  mSynced   = 0;
+  mBlocks.clear();
+  mGrid.clear();
+  mWideBlocks.clear();
+}
+
+bool TrackStore::reserve(qint64 capacity)
+{
+  if (mMap)
+    mDataFile.unmap(mMap);
+  mMap      = 0;
+  mRecords  = 0;
+  mCapacity = 0;
+
+  const qint64 size = sizeof(TrackHeader) + capacity * sizeof(TrackRecord);
+  if (mDataFile.size() < size && !mDataFile.resize(size))
+  {
+    qWarning() << "Unable to grow track store" << mDataFile.fileName();
+    return false;
+  }
+
+  mMap = mDataFile.map(0, size);
+  if (!mMap)
+  {
+    qWarning() << "Unable to map track store" << mDataFile.fileName();
+    return false;
+  }
+  mRecords  = (TrackRecord*)(mMap + sizeof(TrackHeader));
+  mCapacity = capacity;
+  return true;
+}
+
+bool TrackStore::append(const TrackRecord& record)
+{
+  if (!isOpen())
+    return false;
+
+  // Syncer is never left with an unmapped range (rare: the file grows by days of records)
+  if (mCount == mCapacity)
+  {
+    QMutexLocker locker(&mSyncMutex);
+    if (!reserve(mCapacity + TRACK_GROW_SIZE))
+      return false;
+  }
+
+  mRecords[mCount] = record;
+  indexRecord(mCount++);
+  mAppended.store(mCount, std::memory_order_release);
+  return true;
+}
+
+void TrackStore::sync()
+{
+  QMutexLocker locker(&mSyncMutex);
+  syncRecords();
+}
+
+void TrackStore::syncLoop()
+{
+  QMutexLocker locker(&mSyncMutex);
+  while (!mSyncStopping)
+  {
+    mSyncCondition.wait(&mSyncMutex, TRACK_SYNC_INTERVAL);
+    syncRecords();
+  }
+}
+
+void TrackStore::stopSyncer()
+{
+  if (!mSyncer)
+    return;
+
+  {
+    QMutexLocker locker(&mSyncMutex);
+    mSyncStopping = true;
+    mSyncCondition.wakeOne();
+  }
+  mSyncer->wait();
+  delete mSyncer;
+  mSyncer = 0;
+}
+
+// Records, then summaries reach the disk before the header count covers them: neither a crash
+// nor a power loss exposes a partial or zeroed record. Called by the syncer with mSyncMutex
+// locked, or after the syncer is stopped.
+void TrackStore::syncRecords()
+{
+  const int count = mAppended.load(std::memory_order_acquire);
+  if (count == mSynced || !mMap)
+    return;
+
+  if (!syncRange(sizeof(TrackHeader) + (qint64)mSynced * sizeof(TrackRecord),
+                 (qint64)(count - mSynced) * sizeof(TrackRecord)) ||
+      fdatasync(mIndexFile.handle()) != 0)
+  {
+    qWarning() << "Unable to sync track store" << mDataFile.fileName();
+    return;
+  }
+
+  ((TrackHeader*)mMap)->count = count;
+  syncRange(0, sizeof(TrackHeader));
+  mSynced = count;
+}
+
+bool TrackStore::syncRange(qint64 offset, qint64 size)
+{
+  // msync() needs a page aligned address
+  const qint64 page  = sysconf(_SC_PAGESIZE);
+  const qint64 start = offset / page * page;
+  return msync(mMap + start, offset + size - start, MS_SYNC) == 0;
+}
+
+bool TrackStore::isValidBlock(int block)const
+{
+  // Records are appended in time order: the first and the last record must be within the summary
+  const TrackBlock& summary = mBlocks[block];
+  const TrackRecord& first = mRecords[block * TRACK_BLOCK_SIZE];
+  const TrackRecord& last  = mRecords[(block + 1) * TRACK_BLOCK_SIZE - 1];
+  return summary.minTime > 0 && summary.minTime <= summary.maxTime &&
+         summary.minLat <= summary.maxLat && summary.minLon <= summary.maxLon &&
+         summary.minTime <= first.time && summary.maxTime >= last.time;
+}
+
+TrackBlock TrackStore::summarizeBlock(int block)const
+{
+  TrackBlock summary;
+  for(int i = block * TRACK_BLOCK_SIZE; i < (block + 1) * TRACK_BLOCK_SIZE; ++i)
+    extendBlock(summary, mRecords[i]);
+  return summary;
+}
+
+void TrackStore::indexRecord(int index)
+{
+  const int block = index / TRACK_BLOCK_SIZE;
+  if (block == mBlocks.size())
+    mBlocks.append(TrackBlock());
+
+  TrackBlock& summary = mBlocks[block];
+  extendBlock(summary, mRecords[index]);
+
+  // Completed block goes to the index file and to the grid
+  if (index % TRACK_BLOCK_SIZE == TRACK_BLOCK_SIZE - 1)
+  {
+    mIndexFile.write((const char*)&summary, sizeof(summary));
+    mIndexFile.flush();
+    addToGrid(block);
+  }
+}
+
+void TrackStore::addToGrid(int block)
+{
+  const TrackBlock& summary = mBlocks[block];
+  const qint32 y0 = (qint32)floor(summary.minLat / TRACK_GRID_CELL);
+  const qint32 y1 = (qint32)floor(summary.maxLat / TRACK_GRID_CELL);
+  const qint32 x0 = (qint32)floor(summary.minLon / TRACK_GRID_CELL);
+  const qint32 x1 = (qint32)floor(summary.maxLon / TRACK_GRID_CELL);
+
+  if ((qint64)(y1 - y0 + 1) * (x1 - x0 + 1) > TRACK_MAX_BLOCK_CELLS)
+  {
+    mWideBlocks.append(block);
+    return;
+  }
+
+  for(qint32 y = y0; y <= y1; ++y)
+    for(qint32 x = x0; x <= x1; ++x)
+      mGrid[trackCell(y, x)].append(block);
+}
+
+void TrackStore::scanBlocks(const QVector<int>& blocks, const QRectF& box, bool checkBox,
+                            qint64 from, qint64 to, QVector<TrackRecord>& result)const
+{
+  for(int i = 0; i < blocks.size(); ++i)
+  {
+    const TrackBlock& summary = mBlocks[blocks[i]];
+    if (summary.maxTime < from || summary.minTime > to)
+      continue;
+    if (checkBox && (summary.maxLon < box.left() || summary.minLon > box.right() ||
+                     summary.maxLat < box.top()  || summary.minLat > box.bottom()))
+      continue;
+
+    const int end = qMin(mCount, (blocks[i] + 1) * TRACK_BLOCK_SIZE);
+    for(int j = blocks[i] * TRACK_BLOCK_SIZE; j < end; ++j)
+    {
+      const TrackRecord& record = mRecords[j];
+      if (record.time < from || record.time > to)
+        continue;
+      if (checkBox && (record.longitude < box.left() || record.longitude > box.right() ||
+                       record.latitude  < box.top()  || record.latitude  > box.bottom()))
+        continue;
+      result.append(record);
+    }
+  }
+}
+
+QVector<TrackRecord> TrackStore::timeRange(qint64 from, qint64 to)const
+{
+  QVector<int> blocks(mBlocks.size());
+  for(int i = 0; i < blocks.size(); ++i)
+    blocks[i] = i;
+
+  QVector<TrackRecord> result;
+  scanBlocks(blocks, QRectF(), false, from, to, result);
+  return result;
+}
+
+QVector<TrackRecord> TrackStore::boxRange(const QRectF& box, qint64 from, qint64 to)const
+{
+  const QRectF area = box.normalized();
+  const qint32 y0 = (qint32)floor(area.top()    / TRACK_GRID_CELL);
+  const qint32 y1 = (qint32)floor(area.bottom() / TRACK_GRID_CELL);
+  const qint32 x0 = (qint32)floor(area.left()   / TRACK_GRID_CELL);
+  const qint32 x1 = (qint32)floor(area.right()  / TRACK_GRID_CELL);
+
+  // Large boxes are checked against the block summaries directly
+  QVector<int> blocks;
+  if ((qint64)(y1 - y0 + 1) * (x1 - x0 + 1) > mBlocks.size())
+  {
+    blocks.resize(mBlocks.size());
+    for(int i = 0; i < blocks.size(); ++i)
+      blocks[i] = i;
+  }
+  else
+  {
+    for(qint32 y = y0; y <= y1; ++y)
+      for(qint32 x = x0; x <= x1; ++x)
+        blocks += mGrid.value(trackCell(y, x));
+    blocks += mWideBlocks;
+
+    // Open block is not in the grid yet
+    if (mCount % TRACK_BLOCK_SIZE != 0)
+      blocks.append(mBlocks.size() - 1);
+
+    std::sort(blocks.begin(), blocks.end());
+    blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+  }
+
+  QVector<TrackRecord> result;
+  scanBlocks(blocks, area, true, from, to, result);
+  return result;
+}
+
+QVector<TrackRecord> TrackStore::tail(int count)const
+{
+  const int start = qMax(0, mCount - count);
+  QVector<TrackRecord> result(mCount - start);
+  for(int i = start; i < mCount; ++i)
+    result[i - start] = mRecords[i];
+  return result;
+}
@@ -0,0 +1,103 @@
+#ifndef NAVIGINE_QT_TRACK_STORE_H
+#define NAVIGINE_QT_TRACK_STORE_H
+
+#include <atomic>
+#include <limits>
+
+#include <QtCore/QtCore>
+
+// Track point as stored on disk (host byte order)
+struct TrackRecord
+{
+  qint64    time        = 0;      // Wall clock time (milliseconds since epoch)
+  double    latitude    = 0.0;
+  double    longitude   = 0.0;
+  float     accuracy    = 0.0f;
+  float     azimuth     = 0.0f;
+};
+
+// Time and bounding box of a block of consecutive records
+struct TrackBlock
+{
+  qint64    minTime     = std::numeric_limits<qint64>::max();
+  qint64    maxTime     = std::numeric_limits<qint64>::min();
+  double    minLat      = 90.0;
+  double    maxLat      = -90.0;
+  double    minLon      = 180.0;
+  double    maxLon      = -180.0;
+};
+
+// Append-only persistent track of the own device. Records are appended to
+// a memory-mapped file <dir>/track.dat, summaries of completed blocks go to
+// <dir>/track.idx. The block summaries are the time index, the grid index
+// (cell -> blocks overlapping it) is built from them on open, so that opening
+// and queries never read the whole track. Appending only writes memory: a
+// background thread syncs the records to disk, and the record count on disk
+// covers the synced records only.
+class TrackSyncer;
+
+class TrackStore
+{
+    friend class TrackSyncer;
+
+  public:
+    TrackStore();
+    ~TrackStore();
+
+    // Opens or creates the store, fails if it is used by another process
+    bool open(const QString& dirName);
+    void close();
+    bool isOpen()const { return mRecords != 0; }
+
+    bool append(const TrackRecord& record);
+
+    // Syncs the appended records at once (e.g. on exit), otherwise the syncer does it periodically
+    void sync();
+
+    int size()const { return mCount; }
+    const TrackRecord& at(int index)const { return mRecords[index]; }
+
+    // Records of the time range [from, to], in the order of appending
+    QVector<TrackRecord> timeRange(qint64 from, qint64 to)const;
+
+    // Records inside the box (x - longitude, y - latitude) within the time range
+    QVector<TrackRecord> boxRange(const QRectF& box,
+                                  qint64 from = std::numeric_limits<qint64>::min(),
+                                  qint64 to   = std::numeric_limits<qint64>::max())const;
+
+    // The latest records, the oldest first
+    QVector<TrackRecord> tail(int count)const;
+
+  private:
+    bool reserve(qint64 capacity);
+    bool syncRange(qint64 offset, qint64 size);
+    void syncLoop();
+    void syncRecords();
+    void stopSyncer();
+    bool isValidBlock(int block)const;
+    TrackBlock summarizeBlock(int block)const;
+    void indexRecord(int index);
+    void addToGrid(int block);
+    void scanBlocks(const QVector<int>& blocks, const QRectF& box, bool checkBox,
+                    qint64 from, qint64 to, QVector<TrackRecord>& result)const;
+
+    QFile                         mDataFile;      // Holds the exclusive lock while open
+    QFile                         mIndexFile;
+    uchar*                        mMap;           // Mapped data file
+    TrackRecord*                  mRecords;       // Records in the mapped data file
+    qint64                        mCapacity;      // Records the data file has room for
+    int                           mCount;
+
+    TrackSyncer*                  mSyncer;        // Syncs the appended records in the background
+    QMutex                        mSyncMutex;     // Mapping is not replaced while it is synced
+    QWaitCondition                mSyncCondition;
+    bool                          mSyncStopping;
+    std::atomic<int>              mAppended;      // Number of records for the syncer (mCount)
+    int                           mSynced;        // Number of records on disk (the header count)
+
+    QVector<TrackBlock>           mBlocks;        // Time index: summaries of all blocks (the last one is open)
+    QHash<qint64,QVector<int> >   mGrid;          // Grid index: cell -> blocks
+    QVector<int>                  mWideBlocks;    // Blocks spanning too many cells (always scanned)
+};
+
+#endif
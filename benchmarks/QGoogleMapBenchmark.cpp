@@ -0,0 +1,478 @@
+#include <time.h>
+
+#include <QtCore/QtCore>
+#include <QtGui/QtGui>
+#include <QtTest/QtTest>
+
+#include "QGoogleMap.h"
+
+const int     HISTORY_LENGTH  = 1000;   // Track points per target (HISTORY_SIZE of the widget)
+const int     CHUNK_WIDTH     = 640;    // Chunk image size (after cropping)
+const int     CHUNK_HEIGHT    = 560;
+const char    TELEMETRY_LINE[] = "0 0 0 0 0 0 0 1 123 0 35.369120 -75.501340 15 1.23 1 89 12";
+const int     TRACK_LENGTH    = 3 * 24 * 3600;  // Track store records (3 days at 1 Hz)
+const int     IDLE_SECONDS    = 5;      // Duration of the idle CPU measurement
+
+Q_DECLARE_METATYPE(QList<QRectF>)
+
+// Benchmarks of the map widget hot paths.
+// Widgets are painted with QWidget::render(), so no window is shown:
+// run with QT_QPA_PLATFORM=offscreen (Qt 5) or under Xvfb (Qt 4).
+class QGoogleMapBenchmark: public QObject
+{
+    Q_OBJECT
+
+  private slots:
+    void initTestCase();
+    void cleanupTestCase();
+
+    void checkRectCoverage_data();
+    void checkRectCoverage();
+
+    void paint_data();
+    void paint();
+
+    void mapCompositing_data();
+    void mapCompositing();
+
+    void requestMapMemoryHit();
+    void requestMapDiskHit();
+
+    void parseTelemetryLine();
+    void readLine();
+    void idleCpu();
+
+    void trackRendering_data();
+    void trackRendering();
+
+    void trackStoreAppend();
+    void trackStoreTimeRange();
+    void trackStoreBoxRange();
+
+  private:
+    void populateChunks(const QSize& size);
+
+    QString       mHomeDir;     // Temporary home and disk cache, removed on cleanup
+    QGoogleMap*   mMap;
+    TrackStore    mTrackStore;  // Filled by trackStoreAppend
+};
+
+// Removes the directory with all its contents
+static void removeDir(const QString& dirName)
+{
+  QDir dir(dirName);
+  const QFileInfoList entries = dir.entryInfoList(QDir::AllEntries | QDir::NoDotAndDotDot | QDir::Hidden);
+  for(int i = 0; i < entries.size(); ++i)
+  {
+    if (entries[i].isDir())
+      removeDir(entries[i].absoluteFilePath());
+    else
+      dir.remove(entries[i].fileName());
+  }
+  QDir().rmdir(dirName);
+}
+
+void QGoogleMapBenchmark::initTestCase()
+{
+  // Private home and disk cache: the production ones are neither read nor written
+  mHomeDir = QDir::tempPath() + QString("/qgooglemap-benchmark-%1").arg(QCoreApplication::applicationPid());
+  removeDir(mHomeDir);
+  QVERIFY(QDir().mkpath(mHomeDir));
+
+  // Widget and engine are never deleted: their threads can't be stopped
+  TileEngine* engine = new TileEngine("benchmark", mHomeDir + "/cache");
+  mMap = new QGoogleMap(engine, mHomeDir);
+  mMap->mAdjustButton->setChecked(false);
+
+  // No network: chunks are put into the view by the benchmarks themselves
+  disconnect(mMap->mRefreshTimer, SIGNAL(timeout()), mMap, SLOT(refresh()));
+
+  // Same viewport on every run
+  disconnect(QCoreApplication::instance(), SIGNAL(aboutToQuit()), mMap, SLOT(saveState()));
+  mMap->mTrackRecorder = false;
+  mMap->mWarmWatcher->waitForFinished();
+  mMap->mLatitude   = 42.531;
+  mMap->mLongitude  = -71.149;
+  mMap->mMapZoom    = 18;
+  mMap->mZoom       = 18;
+  mMap->mZoomTarget = 18;
+  mMap->mScale      = 1.0;
+}
+
+void QGoogleMapBenchmark::cleanupTestCase()
+{
+  // Queued writes are flushed first, so that nothing is written after the removal
+  mMap->mEngine->stopPersister();
+  mTrackStore.close();
+  removeDir(mHomeDir);
+}
+
+void QGoogleMapBenchmark::populateChunks(const QSize& size)
+{
+  // Chunks covering the viewport with the same padding as refresh() uses
+  mMap->mMapChunks.clear();
+
+  QImage image(CHUNK_WIDTH, CHUNK_HEIGHT, QImage::Format_RGB32);
+  image.fill(qRgb(230, 230, 220));
+
+  const int zoom = mMap->mMapZoom;
+  const QPointF center = mercatorProject(mMap->mLatitude, mMap->mLongitude, zoom);
+  const QStringList types = QStringList() << mMap->mMapType << mMap->mOverlayType;
+
+  for(int x = -size.width(); x <= size.width() + CHUNK_GRID; x += CHUNK_GRID)
+    for(int y = -size.height(); y <= size.height() + CHUNK_GRID; y += CHUNK_GRID)
+      for(int i = 0; i < types.size(); ++i)
+      {
+        double lat, lon;
+        mercatorUnproject(center + QPointF(x, y), zoom, lat, lon);
+        const QString hash = TileEngine::chunkHash(zoom, lat, lon);
+
+        MapChunk chunk;
+        chunk.type      = types[i];
+        chunk.zoom      = zoom;
+        chunk.latitude  = lat;
+        chunk.longitude = lon;
+        chunk.image     = image;
+        mMap->mMapChunks[TileEngine::chunkKey(types[i], hash)] = chunk;
+      }
+}
+
+void QGoogleMapBenchmark::checkRectCoverage_data()
+{
+  QTest::addColumn<QRectF>("area");
+  QTest::addColumn<QList<QRectF> >("chunks");
+
+  // Viewport 1280x720 with the refresh() padding, chunks on the 128 px grid
+  const QRectF area(-640, -360, 2560, 1440);
+  const int counts[] = { 10, 50, 200 };
+
+  for(int i = 0; i < 3; ++i)
+  {
+    qsrand(counts[i]);
+    QList<QRectF> chunks;
+    for(int j = 0; j < counts[i]; ++j)
+    {
+      const int x = (qrand() % 24 - 10) * 128;
+      const int y = (qrand() % 16 - 7)  * 128;
+      chunks.append(QRectF(x, y, CHUNK_WIDTH, CHUNK_HEIGHT));
+    }
+    QTest::newRow(qPrintable(QString("%1 chunks").arg(counts[i]))) << area << chunks;
+  }
+}
+
+void QGoogleMapBenchmark::checkRectCoverage()
+{
+  QFETCH(QRectF, area);
+  QFETCH(QList<QRectF>, chunks);
+
+  QBENCHMARK
+  {
+    CheckRectCoverage(area, chunks);
+  }
+}
+
+void QGoogleMapBenchmark::paint_data()
+{
+  QTest::addColumn<QSize>("size");
+  QTest::addColumn<bool>("overlay");
+  QTest::addColumn<bool>("panels");
+  QTest::addColumn<bool>("cached");
+
+  QTest::newRow("800x480")                  << QSize(800,  480)  << false << false << false;
+  QTest::newRow("1280x720")                 << QSize(1280, 720)  << false << false << false;
+  QTest::newRow("1920x1080")                << QSize(1920, 1080) << false << false << false;
+  QTest::newRow("1920x1080 overlay")        << QSize(1920, 1080) << true  << false << false;
+
+  // Info and performance panels over the map, then over the unchanged (cached) map layer only
+  QTest::newRow("1920x1080 panels")         << QSize(1920, 1080) << false << true  << false;
+  QTest::newRow("1920x1080 panels cached")  << QSize(1920, 1080) << false << true  << true;
+}
+
+void QGoogleMapBenchmark::paint()
+{
+  QFETCH(QSize, size);
+  QFETCH(bool, overlay);
+  QFETCH(bool, panels);
+  QFETCH(bool, cached);
+
+  mMap->cancelAllTargets();
+  mMap->resize(size);
+  mMap->mOverlayOpacity = overlay ? 0.5 : 0.0;
+  populateChunks(size);
+
+  if (panels)
+  {
+    // Same layout as the info text of processSamples()
+    mMap->setInfoText("IP address : 192.168.1.10\n"
+                      "Latency    : 20 ms\n"
+                      "Fix jump   : 0.4 m\n"
+                      "Location   : 42.531000, -71.149000, 15.0\n"
+                      "Direction  : 89.00\n"
+                      "Velocity   : 12.00\n"
+                      "Odometer   : 123.00\n"
+                      "Accel      : 0, 0, 0\n"
+                      "Gyro       : 0, 0, 0\n"
+                      "GPS        : on\n");
+    mMap->mPerfVisible = true;
+    mMap->preparePerfPanel();
+  }
+
+  QImage image(size, QImage::Format_RGB32);
+  QBENCHMARK
+  {
+    // Full redraw: the map layer is composited again
+    if (!cached)
+      mMap->mBackbufferDraws.clear();
+    mMap->render(&image);
+  }
+  mMap->mOverlayOpacity = 0.0;
+  mMap->mPerfVisible    = false;
+  mMap->setInfoText(QString());
+}
+
+void QGoogleMapBenchmark::mapCompositing_data()
+{
+  QTest::addColumn<int>("threads");
+  QTest::addColumn<double>("scale");
+
+  // From one thread to all cores, chunks drawn as is and scaled between zoom levels
+  QList<int> counts;
+  for(int threads = 1; threads < QThread::idealThreadCount(); threads *= 2)
+    counts << threads;
+  counts << QThread::idealThreadCount();
+
+  for(int i = 0; i < counts.size(); ++i)
+  {
+    QTest::newRow(qPrintable(QString("3840x2160 %1 threads").arg(counts[i])))        << counts[i] << 1.0;
+    QTest::newRow(qPrintable(QString("3840x2160 scaled %1 threads").arg(counts[i]))) << counts[i] << 1.3;
+  }
+}
+
+void QGoogleMapBenchmark::mapCompositing()
+{
+  QFETCH(int, threads);
+  QFETCH(double, scale);
+
+  const QSize size(3840, 2160);
+  mMap->cancelAllTargets();
+  mMap->resize(size);
+  mMap->mScale = scale;
+  populateChunks(size);
+
+  QThreadPool* pool = mMap->mCompositePool;
+  const int maxThreads = pool->maxThreadCount();
+  pool->setMaxThreadCount(threads);
+
+  QImage image(size, QImage::Format_RGB32);
+  QBENCHMARK
+  {
+    mMap->mBackbufferDraws.clear();
+    mMap->render(&image);
+  }
+  QVERIFY(mMap->mPerf.compositeBands <= threads);
+
+  pool->setMaxThreadCount(maxThreads);
+  mMap->mScale = 1.0;
+}
+
+void QGoogleMapBenchmark::requestMapMemoryHit()
+{
+  populateChunks(QSize(1280, 720));
+
+  double lat = mMap->mLatitude;
+  double lon = mMap->mLongitude;
+  const int zoom = mMap->mMapZoom;
+  const QString key = TileEngine::chunkKey(mMap->mMapType, TileEngine::chunkHash(zoom, lat, lon));
+
+  MapChunk chunk;
+  chunk.type      = mMap->mMapType;
+  chunk.zoom      = zoom;
+  chunk.latitude  = lat;
+  chunk.longitude = lon;
+  chunk.image     = QImage(CHUNK_WIDTH, CHUNK_HEIGHT, QImage::Format_RGB32);
+  mMap->mMapChunks[key] = chunk;
+
+  QBENCHMARK
+  {
+    mMap->requestMap(mMap->mMapType, lat, lon, zoom);
+  }
+}
+
+void QGoogleMapBenchmark::requestMapDiskHit()
+{
+  mMap->mMapChunks.clear();
+
+  double lat = mMap->mLatitude;
+  double lon = mMap->mLongitude;
+  const int zoom = mMap->mMapZoom;
+  const QString key = TileEngine::chunkKey(mMap->mMapType, TileEngine::chunkHash(zoom, lat, lon));
+
+  // Uncropped 640x640 image, as it comes from the server
+  QImage image(CHUNK_WIDTH, CHUNK_WIDTH, QImage::Format_RGB32);
+  image.fill(qRgb(230, 230, 220));
+  QVERIFY(image.save(mMap->mEngine->chunkFile(key)));
+
+  QBENCHMARK
+  {
+    mMap->mMapChunks.remove(key);
+    mMap->mEngine->mChunks.remove(key);
+    mMap->requestMap(mMap->mMapType, lat, lon, zoom);
+  }
+  QVERIFY(!mMap->mMapChunks.value(key).image.isNull());
+}
+
+void QGoogleMapBenchmark::parseTelemetryLine()
+{
+  const QString line(TELEMETRY_LINE);
+  TelemetrySample sample;
+
+  QBENCHMARK
+  {
+    ::parseTelemetryLine(line, 0, sample);
+  }
+}
+
+void QGoogleMapBenchmark::readLine()
+{
+  // Parsing, target update and info panel preparation
+  mMap->cancelAllTargets();
+  const QString line(TELEMETRY_LINE);
+
+  QBENCHMARK
+  {
+    mMap->onReadLine(line);
+  }
+}
+
+void QGoogleMapBenchmark::idleCpu()
+{
+  // Parked own device reporting 1 Hz fixes that jitter within the accuracy: the frame
+  // timer must stay stopped and nothing is painted. Result is the CPU time of all threads
+  // per second in clock() ticks (CLOCKS_PER_SEC a second, i.e. microseconds on Linux).
+  mMap->cancelAllTargets();
+  mMap->resize(1280, 720);
+  mMap->show();
+
+  TelemetrySample sample;
+  sample.gpsCount = 1;
+  sample.accuracy = 5.0;
+  sample.velocity = 0.0;
+
+  // First fix is animated
+  sample.latitude  = mMap->mLatitude;
+  sample.longitude = mMap->mLongitude;
+  mMap->processSamples(QVector<TelemetrySample>() << sample);
+  QTest::qWait(2000);
+
+  // Counters dump (every 10 s) is monitoring, not the idle path being measured
+  mMap->mPerfTimer->stop();
+  const quint64 paints = mMap->mPerf.paintTime.total();
+  const clock_t start = clock();
+  for(int i = 0; i < IDLE_SECONDS; ++i)
+  {
+    sample.latitude  = mMap->mLatitude  + 1e-5 * (i % 3 - 1);
+    sample.longitude = mMap->mLongitude + 1e-5 * (i % 2);
+    mMap->processSamples(QVector<TelemetrySample>() << sample);
+    QTest::qWait(1000);
+  }
+  const clock_t cpuTicks = clock() - start;
+  mMap->mPerfTimer->start();
+
+  QVERIFY(!mMap->mFrameTimer->isActive());
+  QCOMPARE(mMap->mPerf.paintTime.total(), paints);
+  QTest::setBenchmarkResult((double)cpuTicks / IDLE_SECONDS, QTest::CPUTicks);
+
+  mMap->hide();
+  mMap->cancelAllTargets();
+}
+
+void QGoogleMapBenchmark::trackRendering_data()
+{
+  QTest::addColumn<int>("targets");
+
+  QTest::newRow("own device")  << 1;
+  QTest::newRow("fleet 10")    << 10;
+  QTest::newRow("fleet 100")   << 100;
+}
+
+void QGoogleMapBenchmark::trackRendering()
+{
+  QFETCH(int, targets);
+
+  const QSize size(1280, 720);
+  mMap->resize(size);
+  mMap->mMapChunks.clear();
+  mMap->cancelAllTargets();
+
+  // Tracks crossing the viewport, HISTORY_LENGTH points each
+  for(int id = 0; id < targets; ++id)
+    for(int i = 0; i < HISTORY_LENGTH; ++i)
+    {
+      const double t = (double)i / HISTORY_LENGTH - 0.5;
+      mMap->setTarget(id,
+                      mMap->mLatitude  + 0.002 * t + 0.0001 * id,
+                      mMap->mLongitude + 0.004 * t * cos(i * 0.05),
+                      5.0, i % 360);
+    }
+
+  QImage image(size, QImage::Format_RGB32);
+  QBENCHMARK
+  {
+    mMap->render(&image);
+  }
+  mMap->cancelAllTargets();
+}
+
+void QGoogleMapBenchmark::trackStoreAppend()
+{
+  QVERIFY(mTrackStore.open(mHomeDir + "/benchmark-track"));
+
+  // Loops around the viewport center, one record per second. Records are appended one by one
+  // as processSamples() does, the background syncer runs meanwhile.
+  const qint64 startTime = QDateTime::currentDateTime().toMSecsSinceEpoch() - (qint64)TRACK_LENGTH * 1000;
+  QVector<TrackRecord> records(TRACK_LENGTH);
+  for(int i = 0; i < TRACK_LENGTH; ++i)
+  {
+    TrackRecord& record = records[i];
+    record.time      = startTime + (qint64)i * 1000;
+    record.latitude  = mMap->mLatitude  + 0.05 * sin(i * 0.0005);
+    record.longitude = mMap->mLongitude + 0.05 * cos(i * 0.00065);
+    record.accuracy  = 5.0f;
+    record.azimuth   = i % 360;
+  }
+  QBENCHMARK_ONCE
+  {
+    for(int i = 0; i < TRACK_LENGTH; ++i)
+      mTrackStore.append(records[i]);
+  }
+  QCOMPARE(mTrackStore.size(), TRACK_LENGTH);
+}
+
+void QGoogleMapBenchmark::trackStoreTimeRange()
+{
+  QVERIFY(mTrackStore.size() == TRACK_LENGTH);
+
+  // One hour in the middle of the track
+  const qint64 from = mTrackStore.at(TRACK_LENGTH / 2).time;
+  const qint64 to   = from + 3600 * 1000;
+  QBENCHMARK
+  {
+    QCOMPARE(mTrackStore.timeRange(from, to).size(), 3601);
+  }
+}
+
+void QGoogleMapBenchmark::trackStoreBoxRange()
+{
+  QVERIFY(mTrackStore.size() == TRACK_LENGTH);
+
+  // About 200 x 200 m around a track point, the whole time range
+  const TrackRecord& center = mTrackStore.at(TRACK_LENGTH / 3);
+  const QRectF box(center.longitude - 0.001, center.latitude - 0.001, 0.002, 0.002);
+  QBENCHMARK
+  {
+    QVERIFY(!mTrackStore.boxRange(box).isEmpty());
+  }
+}
+
+QTEST_MAIN(QGoogleMapBenchmark)
+#include "QGoogleMapBenchmark.moc"
@@ -0,0 +1,25 @@
+TARGET  = QGoogleMapBenchmark.exe
+SOURCES += QGoogleMapBenchmark.cpp
+SOURCES += ../QGoogleMap.cpp ../CacheSeeder.cpp ../TelemetryReceiver.cpp ../TrackStore.cpp
+HEADERS += ../QGoogleMap.h ../CacheSeeder.h ../TelemetryReceiver.h ../TrackStore.h
+RESOURCES += ../QGoogleMap.qrc
+INCLUDEPATH += ..
+
+CONFIG += qt
+QT += network
+QT += xml
+QT += testlib
+
+DEFINES += QGOOGLEMAP_NO_MAIN
+
+LIBS += -L$$PWD/../lib -lTileEngine
+PRE_TARGETDEPS += $$PWD/../lib/libTileEngine.a
+
+LIBS += -lz
+
+QMAKE_CXXFLAGS += -O2 -g
+QMAKE_CXXFLAGS += -std=c++11
+
+OBJECTS_DIR = build/
+MOC_DIR     = build/
+RCC_DIR     = build/
@@ -0,0 +1,55 @@
+#!/bin/bash
+#
+# Runs the benchmarks and records the results of the current commit:
+#   ./run_benchmarks.sh [baseline-commit]
+#
+# Results are stored in results/<commit>.tsv (benchmark, value, unit).
+# If a baseline commit is given, its results are compared with the current ones.
+
+cd "$(dirname "$0")"
+
+commit=$(git rev-parse --short HEAD)
+if ! git diff --quiet HEAD -- ..; then
+  commit="$commit-dirty"
+fi
+
+mkdir -p results
+export QT_QPA_PLATFORM=${QT_QPA_PLATFORM:-offscreen}
+
+./QGoogleMapBenchmark.exe -o results/$commit.txt || exit 1
+
+# RESULT : QGoogleMapBenchmark::paint():"1280x720":
+#      1.25 msecs per iteration (total: 80, iterations: 64)
+# Units may be several words ("CPU ticks")
+awk '/^RESULT :/ { name = $3; for (i = 4; i <= NF; ++i) name = name " " $i; next }
+     name != "" && /per iteration/ { unit = $2; for (i = 3; $i != "per"; ++i) unit = unit " " $i
+                                     printf "%s\t%s\t%s\n", name, $1, unit; name = "" }' \
+  results/$commit.txt > results/$commit.tsv
+
+# Compositing scaling: time and speedup over one thread of every thread count
+awk -F'\t' '$1 ~ /::mapCompositing\(\)/ {
+              mode = ($1 ~ / scaled /) ? "scaled" : "exact"
+              threads = $1; sub(/ threads.*/, "", threads); sub(/.* /, "", threads)
+              time[mode, threads] = $2
+              if (threads == 1) one[mode] = $2
+              rows[++n] = mode SUBSEP threads }
+            END { for (i = 1; i <= n; ++i) {
+                    split(rows[i], key, SUBSEP)
+                    if (one[key[1]] > 0)
+                      printf "%-7s %3d threads %10s msecs  x%.2f\n", key[1], key[2], time[rows[i]], one[key[1]] / time[rows[i]] } }' \
+  results/$commit.tsv > results/$commit-scaling.txt
+cat results/$commit-scaling.txt
+
+echo "Results: benchmarks/results/$commit.tsv"
+
+baseline=$1
+if [ -n "$baseline" ]; then
+  baseline=$(git rev-parse --short "$baseline")
+  if [ ! -f results/$baseline.tsv ]; then
+    echo "No results for $baseline"
+    exit 1
+  fi
+  awk -F'\t' 'NR == FNR { base[$1] = $2; next }
+              ($1 in base) && base[$1] > 0 { printf "%-70s %12s %12s %+7.1f%%\n", $1, base[$1], $2, ($2 / base[$1] - 1) * 100 }' \
+    results/$baseline.tsv results/$commit.tsv
+fi